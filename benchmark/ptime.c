@@ -4,6 +4,7 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/resource.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -45,15 +46,42 @@ float timeval_to_sec(struct timeval *tv) {
   return tv->tv_sec + tv->tv_usec / 1000000.0f;
 }
 
+// With -o, wait for the program without sampling it and write a single line
+// "<cpu seconds> <peak resident kb> <exit status>" to <file>, for use by scripts
+// such as ./suite.
 int main(int argc, char *argv[]) {
+  const char *out_name = NULL;
+  if (argc > 2 && strcmp(argv[1], "-o") == 0) {
+    out_name = argv[2];
+    argc -= 2;
+    argv += 2;
+  }
   if (argc < 2) {
-    puts("usage: ptime <program> [arg...]");
+    puts("usage: ptime [-o <file>] <program> [arg...]");
     return 1;
   }
   
   pid_t pid = fork();
-  if (!pid)  // child process
-    return execvp(argv[1], &argv[1]);
+  if (!pid) {  // child process
+    execvp(argv[1], &argv[1]);
+    fatal("execvp");
+  }
+
+  if (out_name) {
+    int status;
+    struct rusage rusage;
+    if (wait4(pid, &status, 0, &rusage) == -1)
+      fatal("wait4");
+    FILE *out = fopen(out_name, "w");
+    if (!out)
+      fatal("fopen");
+    fprintf(out, "%.3f %ld %d\n",
+            timeval_to_sec(&rusage.ru_utime) + timeval_to_sec(&rusage.ru_stime),
+            rusage.ru_maxrss,   // kilobytes on Linux
+            WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+    fclose(out);
+    return 0;
+  }
   
   char *statm_name;
   asprintf(&statm_name, "/proc/%d/statm", pid);
@@ -2504,7 +2504,13 @@ class NewArray : Expression {
       t is Owning ? "_Array" : "_CopyableArray",
       t.EmitGenericType());
     string args = String.Format("&typeid({0}), {1}", t.EmitType(), count_.Emit());
-    return EmitAllocate(array_type, args, LosesOwnership());
+
+    // An array holds its elements in the same allocation, so we can't allocate it on the
+    // stack; an array which never loses ownership lives in an _Own temporary instead.
+    string s = String.Format("{0}::New({1})", array_type, args);
+    if (!LosesOwnership())
+      s = String.Format("{0}({1}).Get()", GType.ConstructType("_Own", array_type), s);
+    return s;
   }
 }
 
@@ -3797,7 +3803,7 @@ class StaticField : Field {
       ai.Emit(w);
       w.WriteLine(";");
       WriteDefinition(w);
-      w.Write("(new {0}", GType.ConstructType("_StaticArray", element_type.EmitGenericType()));
+      w.Write("({0}::New", GType.ConstructType("_CopyableArray", element_type.EmitGenericType()));
       w.Write("(&typeid({0}), {1}, {2}))", element_type.EmitType(), ai.initializers_.Count, varname);
     } else {
       WriteDefinition(w);
@@ -6505,7 +6511,8 @@ class Program {
     StringBuilder sb = new StringBuilder();
     // -o basename, use basename as the executable name
     // -Werror, make all warnings into hard errors
-    sb.AppendFormat("/usr/bin/g++ -o {0} -Werror {1} {2}.cpp",
+    // -pthread, link with the threads library, which the Thread class uses
+    sb.AppendFormat("/usr/bin/g++ -o {0} -Werror -pthread {1} {2}.cpp",
                     basename, dbg_options, basename);
 
     // Append redirection of output
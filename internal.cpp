@@ -28,8 +28,13 @@ OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 //
 // MEMORY_CRT - use CRT malloc() for allocating memory
 // MEMORY_LEA - use Lea memory allocator
+// MEMORY_SIZECLASS - use the size-class allocator below, with per-thread caches of small blocks
 //
-// Either MEMORY_CRT or MEMORY_LEA must be defined.
+// At most one of MEMORY_CRT, MEMORY_LEA and MEMORY_SIZECLASS may be defined; by default we use
+// the Lea allocator on Windows and the size-class allocator elsewhere.
+//
+// SEPARATE_RUNTIME - declare but don't define the runtime's out-of-line functions and static data,
+//   which a separately compiled object provides; gel -j compiles each unit of a program this way
 //
 
 #if defined(_WIN32)
@@ -45,11 +50,11 @@ OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #define _CRT_NONSTDC_NO_DEPRECATE
 #endif
 
-#if !MEMORY_CRT && !MEMORY_LEA
+#if !MEMORY_CRT && !MEMORY_LEA && !MEMORY_SIZECLASS
 #if _WINDOWS
 #define MEMORY_LEA 1  // use Lea allocator by default
 #else
-#define MEMORY_CRT 1  // use CRT by default
+#define MEMORY_SIZECLASS 1  // use size-class allocator by default
 #endif
 #endif
 
@@ -63,7 +68,9 @@ OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <type_traits>
 #include <typeinfo>
+#include <utility>
 #include <wchar.h>
 #include <wctype.h>
 #include <errno.h>
@@ -73,56 +80,594 @@ OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include <new.h>  // for placement new
 
 #elif _UNIX
+#include <pthread.h>
 #include <unistd.h> // _exit is declared here
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <new>
 #endif
 
+#if MEMORY_CRT && defined(__GLIBC__)
+#include <malloc.h>   // for malloc_stats()
+#endif
+
+#ifdef PROFILE_REF_OPS
+#include <signal.h>
+#ifdef __GNUC__
+#include <cxxabi.h>   // for abi::__cxa_demangle
+#endif
+#endif
+
 using std::type_info;
 
 template <class T> class _Array;
 class GlobalString;
+class Pool;
 class String;
 class StringBuilder;
 
 #if MEMORY_LEA
 #define USE_DL_PREFIX 1
 #include "dlmalloc.h"
+#endif
+
+void *Realloc(void *p, size_t size);
+
+// Allocate size bytes of zeroed memory, which operator delete may free.  Large blocks come
+// straight from calloc(), which can hand out fresh pages from the operating system without
+// clearing them.
+void *ZeroAlloc(size_t size);
+
+// Write out any buffered console output; library.cpp defines this.
+void _FlushOutput();
+
+#if _MSC_VER
+#define GEL_NORETURN __declspec(noreturn)
+#else
+#define GEL_NORETURN __attribute__((noreturn, cold))
+#endif
 
-inline void * __cdecl operator new(size_t n) {
-  return dlmalloc(n);
+// Report a runtime error and exit.
+GEL_NORETURN void _AssertFailed(const wchar_t* message);
+
+inline void _assert(bool b, const wchar_t* message) {
+  if (!b)
+    _AssertFailed(message);
 }
 
-inline void * __cdecl operator new[](size_t n) {
-  return dlmalloc(n);
+// A program is single-threaded until it first starts a Thread (see library.cpp).  From then
+// on we update reference counts with atomic instructions and lock the runtime's shared
+// state; until then we avoid their cost.
+extern bool _threaded;
+
+#if !SEPARATE_RUNTIME
+void _AssertFailed(const wchar_t* message) {
+  _FlushOutput();
+  printf("runtime error: %ls\n", message);   // stdout is byte-oriented
+  _exit(1);
 }
 
-inline void __cdecl operator delete(void *p) {
-  dlfree(p);
+bool _threaded = false;
+#endif
+
+#if _MSC_VER
+#define GEL_THREAD_LOCAL __declspec(thread)
+inline int _AtomicIncrement(int *p) { return InterlockedIncrement((long *) p); }
+inline int _AtomicDecrement(int *p) { return InterlockedDecrement((long *) p); }
+inline int _AtomicExchange(int *p, int v) { return InterlockedExchange((long *) p, v); }
+// Volatile accesses have acquire and release semantics in Microsoft C++.
+inline int _AtomicLoad(int *p) { return *(volatile int *) p; }
+inline void _AtomicStore(int *p, int v) { *(volatile int *) p = v; }
+#else
+#define GEL_THREAD_LOCAL __thread
+inline int _AtomicIncrement(int *p) { return __atomic_add_fetch(p, 1, __ATOMIC_RELAXED); }
+inline int _AtomicDecrement(int *p) { return __atomic_sub_fetch(p, 1, __ATOMIC_ACQ_REL); }
+inline int _AtomicExchange(int *p, int v) { return __atomic_exchange_n(p, v, __ATOMIC_ACQ_REL); }
+inline int _AtomicLoad(int *p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+inline void _AtomicStore(int *p, int v) { __atomic_store_n(p, v, __ATOMIC_RELEASE); }
+#endif
+
+// a recursive mutual exclusion lock
+class _Mutex {
+#if _WINDOWS
+  CRITICAL_SECTION cs_;
+
+public:
+  _Mutex() { InitializeCriticalSection(&cs_); }
+  ~_Mutex() { DeleteCriticalSection(&cs_); }
+  void Lock() { EnterCriticalSection(&cs_); }
+  void Unlock() { LeaveCriticalSection(&cs_); }
+#elif _UNIX
+  pthread_mutex_t m_;
+
+public:
+  _Mutex() {
+    pthread_mutexattr_t a;
+    pthread_mutexattr_init(&a);
+    pthread_mutexattr_settype(&a, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&m_, &a);
+    pthread_mutexattr_destroy(&a);
+  }
+  ~_Mutex() { pthread_mutex_destroy(&m_); }
+  void Lock() { pthread_mutex_lock(&m_); }
+  void Unlock() { pthread_mutex_unlock(&m_); }
+#endif
+};
+
+// Hold a mutex for the lifetime of this object, if the program is multithreaded.
+class _Lock {
+  _Mutex &m_;
+  bool locked_;
+
+public:
+  _Lock(_Mutex &m) : m_(m), locked_(_threaded) { if (locked_) m_.Lock(); }
+  ~_Lock() { if (locked_) m_.Unlock(); }
+};
+
+// memory allocation
+//
+// With MEMORY_LEA or MEMORY_SIZECLASS we replace the global operator new and operator delete,
+// so that all of the program's heap objects, strings and arrays come from the chosen
+// allocator.  Setting the environment variable GEL_ALLOC_STATS makes the program print the
+// allocator's statistics at exit; see _AllocReport().
+
+#if MEMORY_SIZECLASS
+// The size-class allocator.  GEL2 programs allocate and free great numbers of small objects,
+// such as tree nodes, hash buckets and boxed values, of a few fixed sizes.  We round each
+// request of up to _SizeClassMax bytes up to a multiple of _SizeClassGrain, and keep free
+// blocks of each size on their own lists.  We carve blocks from spans of _SpanSize bytes,
+// each holding blocks of a single size; all spans lie in a single range of address space
+// which we reserve at the first allocation, so a block's address tells us its size.  Larger
+// requests, and all requests once the range is full, go to malloc().
+//
+// Each thread has a cache of free blocks of each size, which it allocates from and frees to
+// without locking.  A thread whose cache of some size runs dry takes a batch of blocks from a
+// central list, or carves a new span; a thread whose cache grows beyond 2 * _SizeClassBatch
+// blocks returns a batch to the central list.  A block freed by a thread other than the one
+// which allocated it simply joins the freeing thread's cache.  We never return spans to the
+// operating system.
+
+struct _FreeBlock {
+  _FreeBlock *next_;
+};
+
+const size_t _SizeClassGrain = 16;
+const int _SizeClasses = 33;   // class c holds blocks of max(c, 1) * _SizeClassGrain bytes
+const size_t _SizeClassMax = (_SizeClasses - 1) * _SizeClassGrain;
+const size_t _SpanSize = 64 * 1024;
+const int _SizeClassBatch = 256;
+
+#if defined(_WIN64) || defined(__LP64__)
+const size_t _SizeClassRegion = (size_t) 4096 << 20;   // 4 Gb of address space
+#else
+const size_t _SizeClassRegion = (size_t) 256 << 20;
+#endif
+
+struct _SizeClassCache {
+  _FreeBlock *free_[_SizeClasses];
+  int count_[_SizeClasses];
+  int allocs_[_SizeClasses];   // allocations not yet added to _SizeClassStats
+};
+
+extern GEL_THREAD_LOCAL _SizeClassCache _size_class_cache;
+extern char *_size_class_base;
+extern size_t _size_class_reserved;   // bytes reserved at _size_class_base; 0 before we reserve
+extern unsigned char _size_class_of_span[_SizeClassRegion / _SpanSize];
+
+void *_SizeClassRefill(int c);
+void _SizeClassFlush(int c);
+void _SizeClassFlushCache();
+void *_LargeAlloc(size_t n);
+
+inline size_t _SizeClassBytes(int c) {
+  return (c == 0 ? 1 : c) * _SizeClassGrain;
+}
+
+inline void *_SizeClassAlloc(size_t n) {
+  if (n > _SizeClassMax)
+    return _LargeAlloc(n);
+  int c = static_cast<int>((n + _SizeClassGrain - 1) / _SizeClassGrain);
+  _SizeClassCache &cache = _size_class_cache;
+  _FreeBlock *b = cache.free_[c];
+  if (!b)
+    return _SizeClassRefill(c);
+  cache.free_[c] = b->next_;
+  --cache.count_[c];
+  ++cache.allocs_[c];
+  return b;
+}
+
+// Return the offset of p in the reserved range, or a value >= _size_class_reserved if p lies
+// outside it.
+inline size_t _SizeClassOffset(void *p) {
+  return (size_t) p - (size_t) _size_class_base;
 }
 
-inline void __cdecl operator delete[](void *p) {
-  dlfree(p);
+inline void _SizeClassFree(void *p) {
+  size_t offset = _SizeClassOffset(p);
+  if (offset >= _size_class_reserved) {
+    free(p);
+    return;
+  }
+  int c = _size_class_of_span[offset / _SpanSize];
+  _SizeClassCache &cache = _size_class_cache;
+  _FreeBlock *b = static_cast<_FreeBlock *>(p);
+  b->next_ = cache.free_[c];
+  cache.free_[c] = b;
+  if (++cache.count_[c] > 2 * _SizeClassBatch)
+    _SizeClassFlush(c);
 }
+#endif  // MEMORY_SIZECLASS
+
+#if !SEPARATE_RUNTIME
+#if MEMORY_LEA && _UNIX
+// On Windows we link with a separately compiled dlmalloc.obj.  dlmalloc.h has already
+// declared struct mallinfo, which we don't use.
+#define USE_LOCKS 1
+#define MALLOC_ALIGNMENT ((size_t) 16U)
+#define NO_MALLINFO 1
+#include "dlmalloc.c"
+#endif
+
+#if MEMORY_LEA || MEMORY_SIZECLASS
+#if MEMORY_LEA
+inline void *_Alloc(size_t n) { return dlmalloc(n); }
+inline void _Free(void *p) { dlfree(p); }
+#else
+inline void *_Alloc(size_t n) { return _SizeClassAlloc(n); }
+inline void _Free(void *p) { _SizeClassFree(p); }
+#endif
+
+void *operator new(size_t n) { return _Alloc(n); }
+void *operator new[](size_t n) { return _Alloc(n); }
+void operator delete(void *p) noexcept { _Free(p); }
+void operator delete[](void *p) noexcept { _Free(p); }
+void operator delete(void *p, size_t) noexcept { _Free(p); }
+void operator delete[](void *p, size_t) noexcept { _Free(p); }
+#endif
+
+#if MEMORY_SIZECLASS
+GEL_THREAD_LOCAL _SizeClassCache _size_class_cache;
+char *_size_class_base = 0;
+size_t _size_class_reserved = 0;
+unsigned char _size_class_of_span[_SizeClassRegion / _SpanSize];
+
+// state shared by all threads, guarded by _size_class_mutex
+static _Mutex _size_class_mutex;
+static bool _size_class_reserve_tried = false;
+static char *_size_class_next = 0;   // the next span to carve
+static _FreeBlock *_size_class_central[_SizeClasses];
+static int _size_class_central_count[_SizeClasses];
+
+// statistics
+static long long _size_class_allocs[_SizeClasses];
+static int _size_class_spans[_SizeClasses];
+static int _size_class_large = 0;
+
+void *_LargeAlloc(size_t n) {
+  void *p = malloc(n);
+  _assert(p != 0, L"out of memory");
+  _AtomicIncrement(&_size_class_large);
+  return p;
+}
+
+// Return a new span for blocks of class c, or 0 if the reserved range is full.  The caller
+// holds _size_class_mutex.
+static char *_NewSpan(int c) {
+  if (!_size_class_reserve_tried) {
+    _size_class_reserve_tried = true;
+#if _WINDOWS
+    void *p = VirtualAlloc(NULL, _SizeClassRegion, MEM_RESERVE, PAGE_NOACCESS);
+    if (p != NULL) {
+#else
+    void *p = mmap(NULL, _SizeClassRegion, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p != MAP_FAILED) {
+#endif
+      _size_class_base = _size_class_next = static_cast<char *>(p);
+      _size_class_reserved = _SizeClassRegion;
+    }
+  }
+  if ((size_t) (_size_class_next - _size_class_base) + _SpanSize > _size_class_reserved)
+    return 0;
+  char *span = _size_class_next;
+#if _WINDOWS
+  if (VirtualAlloc(span, _SpanSize, MEM_COMMIT, PAGE_READWRITE) == NULL)
+    return 0;
 #endif
+  _size_class_next += _SpanSize;
+  _size_class_of_span[(span - _size_class_base) / _SpanSize] = static_cast<unsigned char>(c);
+  ++_size_class_spans[c];
+  return span;
+}
+
+void *_SizeClassRefill(int c) {
+  _SizeClassCache &cache = _size_class_cache;
+  _Lock lock(_size_class_mutex);
+  _size_class_allocs[c] += cache.allocs_[c] + 1;
+  cache.allocs_[c] = 0;
+
+  _FreeBlock *first = _size_class_central[c];
+  if (first) {
+    _FreeBlock *last = first;
+    int n = 1;
+    for (; n < _SizeClassBatch && last->next_; ++n)
+      last = last->next_;
+    _size_class_central[c] = last->next_;
+    _size_class_central_count[c] -= n;
+    last->next_ = 0;
+    cache.free_[c] = first->next_;
+    cache.count_[c] = n - 1;
+    return first;
+  }
+
+  char *span = _NewSpan(c);
+  if (!span)
+    return _LargeAlloc(_SizeClassBytes(c));
+  size_t size = _SizeClassBytes(c);
+  int count = static_cast<int>(_SpanSize / size);
+  _FreeBlock *list = 0;
+  for (int i = count - 1; i >= 1; --i) {
+    _FreeBlock *b = reinterpret_cast<_FreeBlock *>(span + i * size);
+    b->next_ = list;
+    list = b;
+  }
+  cache.free_[c] = list;
+  cache.count_[c] = count - 1;
+  return span;
+}
+
+void _SizeClassFlush(int c) {
+  _SizeClassCache &cache = _size_class_cache;
+  _FreeBlock *first = cache.free_[c], *last = first;
+  for (int n = 1; n < _SizeClassBatch; ++n)
+    last = last->next_;
+  cache.free_[c] = last->next_;
+  cache.count_[c] -= _SizeClassBatch;
+
+  _Lock lock(_size_class_mutex);
+  last->next_ = _size_class_central[c];
+  _size_class_central[c] = first;
+  _size_class_central_count[c] += _SizeClassBatch;
+  _size_class_allocs[c] += cache.allocs_[c];
+  cache.allocs_[c] = 0;
+}
+
+// Return every block in this thread's cache to the central lists and add its allocations to
+// the statistics.  A thread calls this as it exits, since no other thread can reach its cache.
+void _SizeClassFlushCache() {
+  _SizeClassCache &cache = _size_class_cache;
+  _FreeBlock *last[_SizeClasses];
+  for (int c = 0 ; c < _SizeClasses ; ++c) {
+    last[c] = cache.free_[c];
+    if (last[c])
+      while (last[c]->next_)
+        last[c] = last[c]->next_;
+  }
+
+  _Lock lock(_size_class_mutex);
+  for (int c = 0 ; c < _SizeClasses ; ++c) {
+    if (last[c]) {
+      last[c]->next_ = _size_class_central[c];
+      _size_class_central[c] = cache.free_[c];
+      _size_class_central_count[c] += cache.count_[c];
+      cache.free_[c] = 0;
+      cache.count_[c] = 0;
+    }
+    _size_class_allocs[c] += cache.allocs_[c];
+    cache.allocs_[c] = 0;
+  }
+}
+#endif  // MEMORY_SIZECLASS
 
 void *Realloc(void *p, size_t size) {
 #if MEMORY_CRT
   return realloc(p, size);
 #elif MEMORY_LEA
   return dlrealloc(p, size);
+#elif MEMORY_SIZECLASS
+  size_t offset = _SizeClassOffset(p);
+  if (offset >= _size_class_reserved)
+    return realloc(p, size);
+  size_t old_size = _SizeClassBytes(_size_class_of_span[offset / _SpanSize]);
+  if (size <= old_size)
+    return p;
+  void *q = _SizeClassAlloc(size);
+  memcpy(q, p, old_size);
+  _SizeClassFree(p);
+  return q;
 #else
 #error no memory allocator defined
 #endif
 }
 
-void _assert(bool b, const wchar_t* message) {
-  if (!b) {
-    wprintf(L"runtime error: %s\n", message);
-    _exit(1);
+void *ZeroAlloc(size_t size) {
+#if MEMORY_CRT
+  void *p = calloc(1, size);
+#elif MEMORY_LEA
+  void *p = dlcalloc(1, size);
+#elif MEMORY_SIZECLASS
+  void *p;
+  if (size > _SizeClassMax) {
+    p = calloc(1, size);
+    _AtomicIncrement(&_size_class_large);
+  } else p = memset(_SizeClassAlloc(size), 0, size);
+#endif
+  _assert(p != 0, L"out of memory");
+  return p;
+}
+
+// Print allocator statistics if GEL_ALLOC_STATS is set.  The size-class allocator counts the
+// blocks allocated by other threads which are still running only in batches, so its
+// allocation counts may fall short by the contents of their caches.
+void _AllocReport() {
+  if (!getenv("GEL_ALLOC_STATS"))
+    return;
+#if MEMORY_SIZECLASS
+  _Lock lock(_size_class_mutex);
+  _SizeClassCache &cache = _size_class_cache;
+  long long allocs = 0;
+  int spans = 0;
+  for (int c = 0 ; c < _SizeClasses ; ++c) {
+    _size_class_allocs[c] += cache.allocs_[c];
+    cache.allocs_[c] = 0;
+    allocs += _size_class_allocs[c];
+    spans += _size_class_spans[c];
+  }
+  printf("size-class allocator: %lld small allocations, %d large allocations, %d spans (%d Kb)\n",
+         allocs, _size_class_large, spans, static_cast<int>(spans * (_SpanSize / 1024)));
+  printf("%8s %14s %8s %10s\n", "size", "allocations", "spans", "free");
+  for (int c = 0 ; c < _SizeClasses ; ++c)
+    if (_size_class_allocs[c] > 0)
+      printf("%8d %14lld %8d %10d\n", static_cast<int>(_SizeClassBytes(c)), _size_class_allocs[c],
+             _size_class_spans[c], _size_class_central_count[c] + cache.count_[c]);
+#elif MEMORY_LEA
+  printf("Lea allocator:\n");
+  fflush(stdout);
+  dlmalloc_stats();   // writes to stderr
+#elif MEMORY_CRT && defined(__GLIBC__)
+  printf("CRT allocator:\n");
+  fflush(stdout);
+  malloc_stats();     // writes to stderr
+#else
+  printf("CRT allocator: no statistics available\n");
+#endif
+  fflush(stdout);
+}
+#endif  // !SEPARATE_RUNTIME
+
+#ifdef PROFILE_REF_OPS
+// In a profiling build (gel -p), we count non-owning reference count operations, heap
+// allocations and frees for each class and for each source line.  Generated code calls
+// _PROFILE_SITE() before each statement to say which line is running; at exit (or on
+// SIGUSR1) _ProfileReport() writes the counts out.
+
+enum { _ProfileRefInc, _ProfileRefDec, _ProfileAlloc, _ProfileFree, _ProfilePooled,
+       _ProfileEvents };
+
+class _ProfileCounts {
+public:
+  int count_[_ProfileEvents];
+
+  _ProfileCounts() { memset(count_, 0, sizeof(count_)); }
+};
+
+class _ProfileSite : public _ProfileCounts {
+public:
+  const char *file_;
+  int line_;
+  _ProfileSite *next_;   // the next site in the list _profile_sites
+
+  _ProfileSite(const char *file, int line);
+};
+
+extern GEL_THREAD_LOCAL _ProfileSite *_profile_site;
+
+// A signal handler can't safely write a report, so it only sets _profile_signal; we
+// write the report the next time the program records a count or reaches a statement.
+extern volatile sig_atomic_t _profile_signal;
+
+#if !SEPARATE_RUNTIME
+_Mutex _profile_mutex;
+_ProfileSite *_profile_sites = 0;
+_ProfileSite _profile_no_site("(runtime)", 0);   // code outside any method body
+GEL_THREAD_LOCAL _ProfileSite *_profile_site = 0;
+
+_ProfileSite::_ProfileSite(const char *file, int line) : file_(file), line_(line) {
+  _Lock lock(_profile_mutex);
+  next_ = _profile_sites;
+  _profile_sites = this;
+}
+
+volatile sig_atomic_t _profile_signal = 0;
+#endif
+
+void _ProfileSignalled();
+
+#define _PROFILE_SITE(file, line)                     \
+  do {                                                \
+    static _ProfileSite _site(file, line);            \
+    _profile_site = &_site;                           \
+    if (_profile_signal)                              \
+      _ProfileSignalled();                            \
+  } while (0)
+
+// Each method body holds a _ProfileFrame, so that once a call returns we attribute the
+// rest of the caller's statement to the caller's line.
+class _ProfileFrame {
+  _ProfileSite *site_;
+
+public:
+  _ProfileFrame() : site_(_profile_site) { }
+  ~_ProfileFrame() { _profile_site = site_; }
+};
+
+class _ProfileClass : public _ProfileCounts {
+public:
+  const type_info *type_;
+};
+
+void _ProfileRecord(const type_info &type, int event);
+
+#if !SEPARATE_RUNTIME
+// We find the counts for each class by hashing its type_info address.
+const int _ProfileClassMax = 4096;
+_ProfileClass _profile_classes[_ProfileClassMax];
+
+void _ProfileRecord(const type_info &type, int event) {
+  if (_profile_signal)
+    _ProfileSignalled();
+  _Lock lock(_profile_mutex);
+  _ProfileSite *site = _profile_site ? _profile_site : &_profile_no_site;
+  ++site->count_[event];
+
+  unsigned int i = (unsigned int) ((size_t) &type >> 3) % _ProfileClassMax;
+  for (int n = 0 ; n < _ProfileClassMax ; ++n, i = (i + 1) % _ProfileClassMax) {
+    _ProfileClass *c = &_profile_classes[i];
+    if (c->type_ == 0)
+      c->type_ = &type;
+    if (c->type_ == &type) {
+      ++c->count_[event];
+      return;
+    }
   }
 }
+#endif
+
+// typeid(*p) yields p's dynamic type if T is polymorphic and T itself if not.
+template <class T> inline void _ProfileObject(T *p, int event) {
+  if (p)
+    _ProfileRecord(typeid(*p), event);
+}
+
+// Generated code wraps heap and pool allocations in these calls.
+template <class T> inline T *_ProfileNew(T *p) {
+  _ProfileRecord(typeid(T), _ProfileAlloc);
+  return p;
+}
+
+template <class T> inline T *_ProfilePool(T *p) {
+  _ProfileRecord(typeid(T), _ProfilePooled);
+  return p;
+}
+
+template <class T> inline void _ProfileDelete(T *p) {
+  _ProfileObject(p, _ProfileFree);
+  delete p;
+}
+
+#define _PROFILE_OBJECT(p, event) _ProfileObject(p, event)
+#else
+#define _PROFILE_OBJECT(p, event)
+#endif
+
+// Only a safe build keeps non-owning reference counts.
+#if MEMORY_SAFE
+#define _PROFILE_REF(p, event) _PROFILE_OBJECT(p, event)
+#else
+#define _PROFILE_REF(p, event)
+#endif
 
 // We use 5 different classes for wrapping pointers in GEL2:
 //
@@ -147,7 +692,7 @@ template <class T> class _Own {
 public:
   _Own() { p_ = 0; }
   _Own(T *p) { p_ = p; }
-  ~_Own() { delete p_; }
+  ~_Own() { _PROFILE_OBJECT(p_, _ProfileFree); delete p_; }
 
   T *Get() const { return p_; }
   T * operator -> () { return p_; }
@@ -156,37 +701,50 @@ public:
 
   T * operator = (T *p) {
     if (p != p_) {
+      _PROFILE_OBJECT(p_, _ProfileFree);
       delete p_;
       p_ = p;
     }
     return p;
   }
 
-private:
+  // Generated code moves a value from one _Own to another with std::move() when the
+  // source loses ownership, rather than calling Take() and wrapping the pointer again.
+  _Own(_Own<T> &&o) { p_ = o.p_; o.p_ = 0; }
+  _Own<T> & operator = (_Own<T> &&o) { *this = o.Take(); return *this; }
+
   // disallow copy constructor and copy assignment
-  _Own(const _Own<T> &o) { }
-  _Own<T> & operator = (const _Own<T> &o) { }
+  _Own(const _Own<T> &o) = delete;
+  _Own<T> & operator = (const _Own<T> &o) = delete;
 };
 
-#if MEMORY_SAFE
+// set once the program has finished running, after which we skip reference count checks
+extern bool _exiting;
+
+#if !SEPARATE_RUNTIME
 bool _exiting = false;
+#endif
 
+#if MEMORY_SAFE
 // a non-owning pointer
 template <class T> class _Ptr {
   T *p_;
 
-  void Init(T *p) { p_ = p; if (p_) p_->_PtrInc(); }
+  void Inc() { if (p_) { p_->_PtrInc(); _PROFILE_REF(p_, _ProfileRefInc); } }
+  void Dec() { if (p_) { p_->_PtrDec(); _PROFILE_REF(p_, _ProfileRefDec); } }
+
+  void Init(T *p) { p_ = p; Inc(); }
 
 public:
   _Ptr() { p_ = 0; }
   _Ptr(T *p) { Init(p); }
-  ~_Ptr() { if (!_exiting && p_) p_->_PtrDec(); }
+  ~_Ptr() { if (!_exiting) Dec(); }
 
   T * operator = (T *p) {
     if (p != p_) {
-      if (p_) p_->_PtrDec();
+      Dec();
       p_ = p;
-      if (p_) p_->_PtrInc();
+      Inc();
     }
     return p;
   }
@@ -254,10 +812,21 @@ public:
 
   T* Take() { T *p = p_; if (p) p->_OwnSub(); p_ = 0; return p; }
 
-private:
+  // A move leaves the object's reference count alone, saving the virtual _OwnSub() and
+  // _OwnRefInc() calls which Take() and rewrapping would make.  Clearing the source first
+  // makes x = std::move(x) keep the object.
+  _OwnRef(_OwnRef<T> &&o) { p_ = o.p_; o.p_ = 0; }
+  _OwnRef<T> & operator = (_OwnRef<T> &&o) {
+    T *p = o.p_;
+    o.p_ = 0;
+    if (p_) p_->_OwnRefDec();
+    p_ = p;
+    return *this;
+  }
+
   // disallow copy constructor and copy assignment, since object might be owned
-  _OwnRef(const _OwnRef<T> &o) { }
-  _OwnRef<T> & operator = (const _OwnRef<T> &o) { }
+  _OwnRef(const _OwnRef<T> &o) = delete;
+  _OwnRef<T> & operator = (const _OwnRef<T> &o) = delete;
 };
 
 // a pointer to either an unowned or reference-counted (string) object; we use this for Object
@@ -311,10 +880,6 @@ class Dummy {
 // in two phases and so its reference count may not be zero when ~_Object() first runs.
 const int PendingDestroy = 0x70000000;
 
-#ifdef PROFILE_REF_OPS
-int g_totalRefInc = 0;  // total number of reference count increments
-#endif
-
 // _Object contains only non-virtual methods.  If a GEL2 program never uses a class as
 // an Object, we derive the class from _Object to save a vtable pointer.
 class _Object {
@@ -333,10 +898,9 @@ class _Object {
 public:
   void _PtrInc() {
 #if MEMORY_SAFE
-    ++count_;
-#ifdef PROFILE_REF_OPS
-    ++g_totalRefInc;
-#endif
+    if (_threaded)
+      _AtomicIncrement(&count_);
+    else ++count_;
 #endif
   }
 
@@ -345,7 +909,9 @@ public:
 #if EXTRA_SAFE
     _assert(count_ > 0, "internal ref count failure");
 #endif
-    --count_;
+    if (_threaded)
+      _AtomicDecrement(&count_);
+    else --count_;
 #endif
   }
 
@@ -360,9 +926,23 @@ public:
     _assert(_exiting || count_ == PendingDestroy,
       L"outstanding reference to destroyed pool-allocated object");
   }
+
+  // Check the reference count of a pool-allocated object whose destructor we skipped.
+  void _CheckUndestroyed() {
+    _assert(_exiting || count_ == 0,
+      L"outstanding reference to destroyed pool-allocated object");
+  }
 #endif
 };
 
+// A selective build derives a class from _UncheckedObject rather than _Object if the program
+// never destroys an instance of the class or its subclasses; it holds non-owning pointers to
+// them without reference counts, so they need no count_.
+class _UncheckedObject {
+public:
+  template <class T> T _Addr() { return static_cast<T>(this); }
+};
+
 // In _Destroy1(), note that the constructor call is non-virtual;
 // without the _Class:: prefix it would be virtual.
 #define DESTROY1(_Class)        \
@@ -381,12 +961,27 @@ public:
 #define GEL_OBJECT(_Class) DESTROY1(_Class)
 #endif
 
+// Class IDs.  The compiler numbers the classes it generates in preorder starting at
+// _FirstClassId, so the IDs of a class C and all its subclasses form the range
+// [C::_class_id, C::_class_last] and a subtype test is a virtual call and one compare.
+// Classes without an ID of their own (including most extern classes) inherit
+// _NoClassId from Object, and tests against them fall back to dynamic_cast.
+enum { _NoClassId = -1, _StringClassId, _BoolClassId, _CharClassId, _IntClassId,
+       _DoubleClassId, _SingleClassId, _FirstClassId };
+
+#define GEL_CLASS_ID(_Id, _Last)                  \
+  enum { _class_id = _Id, _class_last = _Last };  \
+  virtual int _ClassId() { return _Id; }
+
 class Object : public _Object {
 public:
+  enum { _class_id = _NoClassId, _class_last = _NoClassId };
+  virtual int _ClassId() { return _NoClassId; }
+
   virtual void _OwnRefInc() { }
-  virtual void _OwnRefDec() { delete this; }
-  virtual void _PtrRefInc() { _PtrInc(); }
-  virtual void _PtrRefDec() { _PtrDec(); }
+  virtual void _OwnRefDec() { _PROFILE_OBJECT(this, _ProfileFree); delete this; }
+  virtual void _PtrRefInc() { _PtrInc(); _PROFILE_REF(this, _ProfileRefInc); }
+  virtual void _PtrRefDec() { _PtrDec(); _PROFILE_REF(this, _ProfileRefDec); }
 
   virtual void _OwnSub() { }
 
@@ -407,42 +1002,69 @@ public:
 #endif
 };
 
+template <class T> struct _Pointee;
+template <class T> struct _Pointee<T *> { typedef T Type; };
+
+// Return true if the non-null object o is an instance of C.  The test on C::_class_id is
+// a compile-time constant, so only one branch survives.
+template <class C> inline bool _IsInstance(Object *o) {
+  const int id = C::_class_id, last = C::_class_last;
+  if (id == _NoClassId)
+    return dynamic_cast<C *>(o) != 0;
+  return (unsigned) (o->_ClassId() - id) <= (unsigned) (last - id);
+}
+
+// Return o as a C *, or 0 if o is null or not an instance of C.
+template <class C> inline C *_As(Object *o) {
+  return o && _IsInstance<C>(o) ? static_cast<C *>(o) : 0;
+}
+
 // Cast an (Object *) to the pointer type T.
 template <class T> T _Cast(Object *o) {
   if (!o)
     return 0;
-  T b = dynamic_cast<T>(o);
-  _assert(b != 0, L"type cast failed");
-  return b;
+  _assert(_IsInstance<typename _Pointee<T>::Type>(o), L"type cast failed");
+  return static_cast<T>(o);
 }
 
 template <class T> T _Unbox(Object *o) {
   _assert(o != 0, L"unboxing conversion failed: source is null");
-  T b = dynamic_cast<T>(o);
-  _assert(b != 0, L"unboxing conversion failed");
-  return b;
+  _assert(_IsInstance<typename _Pointee<T>::Type>(o), L"unboxing conversion failed");
+  return static_cast<T>(o);
 }
 
 class String : public Object {
+ public:
+  GEL_CLASS_ID(_StringClassId, _StringClassId)
+
  protected:
   const wchar_t *s_;
   int length_;     // the number of characters in the string
+  int hash_;       // cached hash code, or 0 if not yet computed
 #if !MEMORY_SAFE
   int count_;     // reference count for this object
 #endif
 
-  void _Dec() {
+  // Decrement our reference count and return its new value.
+  int _Dec() {
 #if EXTRA_SAFE
     _assert(count_ > 0, "internal string ref count failure");
 #endif
-    --count_;
+    return _threaded ? _AtomicDecrement(&count_) : --count_;
   }
 
  public:
   // (Note that _RefInc and _RefDec can't call _PtrInc and _PtrDec since those functions
   // do nothing in an unsafe build.)
-  void _RefInc() { ++count_; }
-  void _RefDec() { _Dec(); if (!count_) delete this; }
+  void _RefInc() {
+    if (_threaded)
+      _AtomicIncrement(&count_);
+    else ++count_;
+  }
+  void _RefDec() { if (!_Dec()) _Free(); }
+
+  // Free this string once its reference count drops to zero.
+  virtual void _Free() { delete this; }
 
   virtual void _OwnRefInc() { _RefInc(); }
   virtual void _OwnRefDec() { _RefDec(); }
@@ -458,30 +1080,70 @@ class String : public Object {
 #endif
     s_ = s;
     length_ = wcslen(s_);
+    hash_ = 0;
+  }
+
+  String(const wchar_t *s, int length) {
+#if !MEMORY_SAFE
+    count_ = 0;
+#endif
+    s_ = s;
+    length_ = length;
+    hash_ = 0;
   }
 
   bool _Equals(const wchar_t *s) {
-    return !wcscmp(s_, s);
+    return !wcscmp(Get(), s);
+  }
+
+  // Compare lengths and any cached hash codes before comparing characters.
+  bool _Equals(String *s) {
+    return length_ == s->length_ &&
+           (hash_ == 0 || s->hash_ == 0 || hash_ == s->hash_) &&
+           !wmemcmp(s_, s->s_, length_);
   }
 
   static StringPtr New(_Array<wchar_t> *a);
 
-  const wchar_t * Get() { return s_; }
+  // Return this string's characters with a terminating NUL.  A slice (see SliceString) is
+  // generally not terminated, so Get() copies its characters on first use.
+  const wchar_t * Get() {
+    if (s_[length_] != L'\0')
+      _Terminate();
+    return s_;
+  }
+
+  // Return this string's characters, which are not necessarily NUL-terminated.
+  const wchar_t * _Data() { return s_; }
+
+  virtual void _Terminate() { }
+
+  // Return the string which owns the buffer holding our characters.
+  virtual String *_Buffer() { return this; }
+
+  // If this string is a slice, copy its characters so that it no longer keeps its
+  // parent string alive.
+  virtual void Compact() { }
 
   static bool _Equals(String *s1, String *s2) {
-    return !s1 && !s2 ||
-           s1 && s2 && s1->_Equals(s2->s_);
+    return s1 == s2 ||
+           s1 && s2 && s1->_Equals(s2);
   }
 
   virtual bool Equals(Object *o) {
-    return _Equals(this, dynamic_cast<String *>(o));
+    return _Equals(this, _As<String>(o));
   }
 
+  // We compute the hash code on first use and cache it; strings are immutable.  (Threads
+  // computing a shared string's hash at the same time will store the same value.)
   virtual int GetHashCode() {
-    int h = 0;
-    for (const wchar_t *s = s_; *s; ++s)
-      h = h * 17 + *s;
-    return h;
+    if (hash_ == 0) {
+      int h = 0;
+      for (int i = 0; i < length_; ++i)
+        h = h * 17 + s_[i];
+      hash_ = h;
+    }
+    return hash_;
   }
 
   virtual StringPtr ToString() { return this; }
@@ -496,12 +1158,13 @@ class String : public Object {
   }
 
   static int CompareOrdinal(String *s, String *t) {
-    return wcscmp(s->Get(), t->Get());
+    int c = wmemcmp(s->s_, t->s_, s->length_ < t->length_ ? s->length_ : t->length_);
+    return c != 0 ? c : s->length_ - t->length_;
   }
 
   bool EndsWith(String *s) {
     return s->length_ <= length_ && 
-           !wcscmp(s_ + length_ - s->length_, s->s_);
+           !wmemcmp(s_ + length_ - s->length_, s->s_, s->length_);
   }
 
   bool EndsWithChar(wchar_t c) {
@@ -516,7 +1179,7 @@ class String : public Object {
    * Return the first index of a wide character c. 
    */
   int IndexOf(wchar_t c) {
-    const wchar_t *p = wcschr(s_, c);
+    const wchar_t *p = wmemchr(s_, c, length_);
     return p ? static_cast<int>(p - s_) : -1;
   }
 
@@ -524,8 +1187,10 @@ class String : public Object {
    * the string. 
    */
   int LastIndexOf(wchar_t c) {
-    const wchar_t *p = wcsrchr(s_, c);
-    return p ? static_cast<int>(p - s_) : -1;
+    for (int i = length_ - 1; i >= 0; --i)
+      if (s_[i] == c)
+        return i;
+    return -1;
   }
 
   int get_Length() {
@@ -533,7 +1198,7 @@ class String : public Object {
   }
 
   bool StartsWith(String *s) {
-    return s->length_ <= length_ && !wcsncmp(s_, s->s_, s->length_);
+    return s->length_ <= length_ && !wmemcmp(s_, s->s_, s->length_);
   }
 
   StringPtr Substring(int start_index, int length);
@@ -544,16 +1209,27 @@ public:
   GlobalString(const wchar_t * s) : String(s) {
     _RefInc();
   }
+
+  // A GlobalString has static storage and is never freed.
+  virtual void _Free() { }
 };
 
 // Duplicate a string.  We can't call wcsdup since we might not be using the CRT allocator.
+const wchar_t * Duplicate(const wchar_t * s);
+
+// Convert a multibyte string to a wide string; the caller must free the result.
+const wchar_t *MultiByteToWide(const char *s);
+
+// Convert a wide string to a multibyte string; the caller must free the result.
+const char *WideToMultiByte(const wchar_t *s);
+
+#if !SEPARATE_RUNTIME
 const wchar_t * Duplicate(const wchar_t * s) {
   wchar_t * p = new wchar_t[wcslen(s) + 1];
   wcscpy(p, s);
   return p;
 }
 
-// Convert a multibyte string to a wide string; the caller must free the result.
 const wchar_t *MultiByteToWide(const char *s) {
   int n = mbstowcs(NULL, s, 0) + 1;
   wchar_t *w = new wchar_t[n];
@@ -561,18 +1237,19 @@ const wchar_t *MultiByteToWide(const char *s) {
   return w;
 }
 
-// Convert a wide string to a multibyte string; the caller must free the result.
 const char *WideToMultiByte(const wchar_t *s) {
   int n = wcstombs(NULL, s, 0) + 1;
   char *t = new char[n];
   wcstombs(t, s, n);
   return t;
 }
+#endif
 
 // a string whose characters are stored in heap-allocated memory
 class DynamicString : public String {
 public:
   DynamicString(const wchar_t * s) : String(s) { }
+  DynamicString(const wchar_t * s, int length) : String(s, length) { }
   DynamicString(const wchar_t * s, bool copy) : String(copy ? Duplicate(s) : s) { }
 
   DynamicString(const char *s) : String(MultiByteToWide(s)) { }
@@ -580,6 +1257,78 @@ public:
   ~DynamicString() { delete [] s_; }
 };
 
+// a string whose characters are stored in the same heap block as the string itself,
+// immediately following the object
+class InlineString : public String {
+  InlineString(int length) : String(reinterpret_cast<wchar_t *>(this + 1), length) {
+    Chars()[length] = L'\0';
+  }
+
+  static void *operator new(size_t size, int length) {
+    return ::operator new(size + (length + 1) * sizeof(wchar_t));
+  }
+
+  // used only if the constructor throws
+  static void operator delete(void *p, int) { ::operator delete(p); }
+
+public:
+  static void operator delete(void *p) { ::operator delete(p); }
+
+  // Allocate a string of the given length; the caller fills in its characters via Chars().
+  static InlineString *New(int length) { return new (length) InlineString(length); }
+
+  // Allocate a string holding a copy of the given characters.
+  static InlineString *New(const wchar_t *s, int length) {
+    InlineString *t = New(length);
+    wmemcpy(t->Chars(), s, length);
+    return t;
+  }
+
+  static InlineString *New(const wchar_t *s) { return New(s, static_cast<int>(wcslen(s))); }
+
+  wchar_t *Chars() { return const_cast<wchar_t *>(s_); }
+};
+
+// a string whose characters are a range of the characters of some other string, which
+// it keeps alive; Substring() returns these to avoid copying
+class SliceString : public String {
+  StringPtr parent_;   // the string owning our characters, or NULL once we've been compacted
+  wchar_t *copy_;      // our own copy of our characters, once compacted
+
+public:
+  SliceString(String *parent, const wchar_t *s, int length)
+    : String(s, length), parent_(parent), copy_(NULL) { }
+
+  ~SliceString() { delete [] copy_; }
+
+  virtual void _Terminate() { Compact(); }
+
+  virtual String *_Buffer() { return copy_ ? this : parent_.Get(); }
+
+  static _Mutex mutex_;
+
+  virtual void Compact() {
+    if (copy_)
+      return;
+    _Lock lock(mutex_);
+    if (copy_)    // another thread compacted us while we waited for the lock
+      return;
+    wchar_t *c = new wchar_t[length_ + 1];
+    wmemcpy(c, s_, length_);
+    c[length_] = L'\0';
+    s_ = c;
+    copy_ = c;
+
+    // Another thread may still be reading our characters from our parent's buffer, so
+    // once the program is multithreaded we keep the parent alive.
+    if (!_threaded)
+      parent_ = NULL;
+  }
+};
+
+#if !SEPARATE_RUNTIME
+_Mutex SliceString::mutex_;
+
 /* static */ StringPtr String::_Concat(Object *o1, Object *o2) {
   StringPtr s1 = o1 == NULL ? NULL : o1->ToString();
   StringPtr s2 = o2 == NULL ? NULL : o2->ToString();
@@ -590,13 +1339,12 @@ public:
   if (s2 == NULL)
     return s1;
 
-  int len1 = wcslen(s1->s_);
-  int len2 = wcslen(s2->s_);
-  wchar_t * s = new wchar_t[len1 + len2 + 1];
-  memcpy(s, s1->s_, len1 * sizeof(wchar_t));
-  memcpy(s + len1, s2->s_, len2 * sizeof(wchar_t));
-  s[len1 + len2] = L'\0';
-  return new DynamicString(s);
+  int len1 = s1->length_;
+  int len2 = s2->length_;
+  InlineString *s = InlineString::New(len1 + len2);
+  wmemcpy(s->Chars(), s1->s_, len1);
+  wmemcpy(s->Chars() + len1, s2->s_, len2);
+  return s;
 }
 
 /* Returns a substring starting at start_index, with [length] characters. */
@@ -604,16 +1352,21 @@ StringPtr String::Substring(int start_index, int length) {
   static const wchar_t out_of_bounds[] = L"substring index out of bounds";
   _assert(start_index >= 0, out_of_bounds);
   _assert(start_index + length <= length_, out_of_bounds);  
-  wchar_t * s = new wchar_t[length + 1];
-  memcpy(s, s_ + start_index, length * sizeof(wchar_t));
-  s[length] = L'\0';
-  return new DynamicString(s);
+  // We copy short substrings, since a slice costs nearly as much as a copy and would keep
+  // the whole parent string alive.
+  const int SliceThreshold = 16;
+  if (length == length_)
+    return this;
+  if (length < SliceThreshold)
+    return InlineString::New(s_ + start_index, length);
+  return new SliceString(_Buffer(), s_ + start_index, length);
 }
 
 GlobalString Object::object_string_ = L"<object>";
 GlobalString String::empty_string_ = L"";
 
 /* virtual */ StringPtr Object::ToString() { return &object_string_; }
+#endif
 
 class MultiByteString {
   const char *m_;
@@ -636,11 +1389,13 @@ class Bool : public Object {
   bool b_;
 
 public:
+  GEL_CLASS_ID(_BoolClassId, _BoolClassId)
+
   Bool(bool b) { b_ = b; }
   bool Value() { return b_; }
 
   virtual bool Equals(Object *o) {
-    Bool *b = dynamic_cast<Bool *>(o);
+    Bool *b = _As<Bool>(o);
     return b != NULL && b_ == b->b_;
   }
 
@@ -651,18 +1406,22 @@ public:
   virtual StringPtr ToString() { return b_ ? &true_string_ : &false_string_; }
 };
 
+#if !SEPARATE_RUNTIME
 GlobalString Bool::true_string_ = L"True";
 GlobalString Bool::false_string_ = L"False";
+#endif
 
 class Char : public Object {
   wchar_t c_;
 
 public:
+  GEL_CLASS_ID(_CharClassId, _CharClassId)
+
   Char(wchar_t c) { c_ = c; }
   wchar_t Value() { return c_; }
 
   virtual bool Equals(Object *o) {
-    Char *c = dynamic_cast<Char *>(o);
+    Char *c = _As<Char>(o);
     return c != NULL && c_ == c->c_;
   }
 
@@ -672,7 +1431,7 @@ public:
     wchar_t s[2];
     s[0] = c_;
     s[1] = L'\0';
-    return new DynamicString(s, true);
+    return InlineString::New(s);
   }
 
   static bool IsDigit(wchar_t c) {
@@ -690,22 +1449,22 @@ public:
 
 class NumberStyles {
 public:
-  static int const Integer, HexNumber;
+  static int const Integer = 0, HexNumber = 1;
 };
-int const NumberStyles::Integer = 0;
-int const NumberStyles::HexNumber = 1;
 
 class Int : public Object {
   int i_;
 
 public:
+  GEL_CLASS_ID(_IntClassId, _IntClassId)
+
   Int(int i) { i_ = i; }
   int Value() { return i_; }
 
   static int Max(int i, int j) { return i > j ? i : j; }
 
   virtual bool Equals(Object *o) {
-    Int *i = dynamic_cast<Int *>(o);
+    Int *i = _As<Int>(o);
     return (i != NULL && i_ == i->i_);
   }
 
@@ -715,7 +1474,7 @@ public:
     const int kBufSize = 20;
     wchar_t buf[kBufSize];
     swprintf(buf, kBufSize, L"%d", i_);
-    return new DynamicString(buf, true);
+    return InlineString::New(buf);
   }
 
   static int Parse(String *s) {
@@ -761,11 +1520,13 @@ class Double : public Object {
   double d_;
 
 public:
+  GEL_CLASS_ID(_DoubleClassId, _DoubleClassId)
+
   Double(double d) { d_ = d; }
   double Value() { return d_; }
 
   virtual bool Equals(Object *o) {
-    Double *d = dynamic_cast<Double *>(o);
+    Double *d = _As<Double>(o);
     return (d != NULL && d_ == d->d_);
   }
 
@@ -778,7 +1539,7 @@ public:
     const int kBufSize = 20;
     wchar_t buf[kBufSize];
     swprintf(buf, kBufSize, L"%.10g", d);
-    return new DynamicString(buf, true);
+    return InlineString::New(buf);
   }
 
   virtual StringPtr ToString() {
@@ -794,11 +1555,13 @@ class Single : public Object {
   float f_;
 
 public:
+  GEL_CLASS_ID(_SingleClassId, _SingleClassId)
+
   Single(float f) { f_ = f; }
   float Value() { return f_; }
 
   virtual bool Equals(Object *o) {
-    Single *s = dynamic_cast<Single *>(o);
+    Single *s = _As<Single>(o);
     return (s != NULL && f_ == s->f_);
   }
 
@@ -827,16 +1590,24 @@ class Array : public Object {
     _assert(index >= 0 && index < length_, L"array index out of bounds");
   }
 
+  // Type names are usually merged, so comparing the type_info pointers first avoids
+  // a string comparison in the common case.
+  static bool _SameType(const type_info *t1, const type_info *t2) {
+    return t1 == t2 || *t1 == *t2;
+  }
+
  public:
   int get_Length() {
     return length_;
   }
 
   virtual void _Copy(int source_index, Array *dest, int dest_index, int length) = 0;
+  virtual void _Clear(int index, int length) = 0;
 
   static void Copy(Array *source, int source_index, Array *dest, int dest_index, int length) {
-    _assert(*(source->element_type_) == *(dest->element_type_), L"can't copy between arrays of different types");
+    _assert(_SameType(source->element_type_, dest->element_type_), L"can't copy between arrays of different types");
     static const wchar_t out_of_bounds[] = L"array copy index out of bounds";
+    _assert(length >= 0, out_of_bounds);
     _assert(source_index >= 0, out_of_bounds);
     _assert(source_index + length <= source->length_, out_of_bounds);
     _assert(dest_index >= 0, out_of_bounds);
@@ -847,97 +1618,237 @@ class Array : public Object {
   void CopyTo(Array *arr, int index) {
     return Copy(this, 0, arr, index, length_);
   }
+
+  // Set length elements starting at index to their default value, destroying any objects
+  // they own.
+  static void Clear(Array *a, int index, int length) {
+    static const wchar_t out_of_bounds[] = L"array clear index out of bounds";
+    _assert(index >= 0 && length >= 0, out_of_bounds);
+    _assert(index + length <= a->length_, out_of_bounds);
+    a->_Clear(index, length);
+  }
+
+  // Set every element of an array to the given value.
+  static void Fill(_Array<bool> *a, bool value);
+  static void Fill(_Array<wchar_t> *a, wchar_t value);
+  static void Fill(_Array<int> *a, int value);
+  static void Fill(_Array<float> *a, float value);
+  static void Fill(_Array<double> *a, double value);
+  static void Fill(_Array<StringPtr> *a, String *value);
 };
 
+// An array's elements follow its header in a single allocation, so creating an array costs
+// one allocation and reaching an element costs no extra indirection.  Arrays are created
+// only through New(), which allocates zeroed storage; a zeroed element is a null pointer or
+// zero value for every element type the compiler emits.
 template <class T> class _Array : public Array {
 protected:
-  T *a_;
+  _Array(const type_info *element_type, int length) : Array(element_type, length) { }
+
+  static size_t Bytes(int length) {
+    _assert(length >= 0, L"array length must not be negative");
+    return sizeof(_Array<T>) + length * sizeof(T);
+  }
+
+  // the size of the array in a pool, which keeps its objects pointer-aligned
+  static size_t PoolBytes(int length) {
+    return (Bytes(length) + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+  }
+
+  static void *operator new(size_t size, int length) { return ZeroAlloc(Bytes(length)); }
 
-  _Array(const type_info *element_type, int length, T *init) : Array(element_type, length) {
-    a_ = init;
+  // If trivial is true, then destroying the array does nothing; see Pool::Alloc().
+  static void *operator new(size_t size, Pool *pool, int length, bool trivial) {
+    size_t n = PoolBytes(length);
+    return memset(PoolAlloc(pool, n, trivial), 0, n);
   }
 
+  // used only if the constructor throws
+  static void operator delete(void *p, int) { ::operator delete(p); }
+  static void operator delete(void *p, Pool *, int, bool) { }
+
+  static char *PoolAlloc(Pool *pool, size_t n, bool trivial);
+
 public:
-  _Array(const type_info *element_type, int length) : Array(element_type, length) {
-    a_ = new T[length];
-    memset(a_, 0, length * sizeof(T));
+  static void operator delete(void *p) { ::operator delete(p); }
+
+  static _Array<T> *New(const type_info *element_type, int length) {
+    return new (length) _Array<T>(element_type, length);
   }
 
+  static _Array<T> *New(Pool *pool, const type_info *element_type, int length,
+                        bool trivial = false) {
+    return new (pool, length, trivial) _Array<T>(element_type, length);
+  }
+
+  // Destroy the elements in reverse order, as delete [] would.
   ~_Array() {
-    delete [] a_;
+    T *a = Elements();
+    for (int i = length_ - 1 ; i >= 0 ; --i)
+      a[i].~T();
   }
 
+  T *Elements() { return reinterpret_cast<T *>(this + 1); }
+
   T &get_Item(int index) {
     Check(index);
-    return a_[index];
+    return Elements()[index];
   }
 
   T *get_location(int index) {
     Check(index);
-    return &a_[index];
+    return &Elements()[index];
   }
 
+  // The compiler emits these for indices it has proved within bounds.
+  T &_UncheckedItem(int index) { return Elements()[index]; }
+  T *_UncheckedLocation(int index) { return &Elements()[index]; }
+
   _Array<T> *CheckType(const type_info *type) {
-    _assert(*element_type_ == *type, L"type cast failed: array has wrong type");
+    _assert(_SameType(element_type_, type), L"type cast failed: array has wrong type");
     return this;
   }
 
   virtual void _Copy(int source_index, Array * dest, int dest_index, int n) {
     _assert(false, L"can't copy elements between owning arrays");
   }
+
+  virtual void _Clear(int index, int n) {
+    T *p = Elements() + index;
+    if (!std::is_trivially_destructible<T>::value)
+      for (int i = n - 1 ; i >= 0 ; --i)
+        p[i].~T();
+    memset((void *) p, 0, n * sizeof(T));
+  }
+
+  // A pool walks its objects by size, so a pool-allocated array reports its own.
+  virtual size_t _Destroy1() {
+    size_t n = PoolBytes(length_);
+    this->~_Array();
+    return n;
+  }
+
+#if MEMORY_SAFE
+  virtual size_t _Destroy2() { return PoolBytes(length_); }
+#endif
 };
 
 template <class T> class _CopyableArray : public _Array<T> {
 protected:
-  _CopyableArray(const type_info *element_type, int length, T *init)
-    : _Array<T>(element_type, length, init) { }
-
-public:
   _CopyableArray(const type_info *element_type, int length)
     : _Array<T>(element_type, length) { }
 
-  virtual void _Copy(int source_index, Array *dest, int dest_index, int n) {
-    _CopyableArray<T> *d = static_cast<_CopyableArray<T> *>(dest);
-    // We can't use memmove since array elements may be reference-counted pointers.
-    T *p = this->a_ + source_index;   // gcc 3.4.4 needs "this->" here
-    T *end = p + n;
-    T *q = d->a_ + dest_index;
-    while (p < end)
-      *q++ = *p++;
+public:
+  static _CopyableArray<T> *New(const type_info *element_type, int length) {
+    return new (length) _CopyableArray<T>(element_type, length);
   }
-};
 
-// an array whose elements are statically allocated
-template <class T> class _StaticArray : public _CopyableArray<T> {
-public:
-  _StaticArray(const type_info *element_type, int length, T *init)
-  : _CopyableArray<T>(element_type, length, init) { }
+  static _CopyableArray<T> *New(Pool *pool, const type_info *element_type, int length,
+                                bool trivial = false) {
+    return new (pool, length, trivial) _CopyableArray<T>(element_type, length);
+  }
 
-  ~_StaticArray() {
-    this->a_ = 0;  // gcc 3.4.4 needs "this->" here
+  // Allocate an array holding a copy of a static array initializer.
+  static _CopyableArray<T> *New(const type_info *element_type, int length, const T *init) {
+    _CopyableArray<T> *a = New(element_type, length);
+    T *p = a->Elements();
+    for (int i = 0 ; i < length ; ++i)
+      p[i] = init[i];
+    return a;
   }
 
+  // Overlapping ranges of the same array are copied as if through a temporary array.
+  virtual void _Copy(int source_index, Array *dest, int dest_index, int n) {
+    _CopyableArray<T> *d = static_cast<_CopyableArray<T> *>(dest);
+    T *p = this->Elements() + source_index;   // gcc 3.4.4 needs "this->" here
+    T *q = d->Elements() + dest_index;
+    if (std::is_trivially_copyable<T>::value) {
+      memmove((void *) q, (const void *) p, n * sizeof(T));
+      return;
+    }
+    // Elements such as reference-counted pointers must be copied by assignment.
+    if (q > p && q < p + n)
+      for (int i = n - 1 ; i >= 0 ; --i)
+        q[i] = p[i];
+    else
+      for (int i = 0 ; i < n ; ++i)
+        q[i] = p[i];
+  }
 };
 
+// a simple loop, which the C++ compiler vectorizes for element types other than pointers
+template <class T, class V> inline void _Fill(_Array<T> *a, V value) {
+  T *p = a->Elements();
+  int n = a->get_Length();
+  for (int i = 0 ; i < n ; ++i)
+    p[i] = value;
+}
+
+inline void Array::Fill(_Array<bool> *a, bool value) {
+  memset(a->Elements(), value, a->get_Length() * sizeof(bool));
+}
+inline void Array::Fill(_Array<wchar_t> *a, wchar_t value) { _Fill(a, value); }
+inline void Array::Fill(_Array<int> *a, int value) { _Fill(a, value); }
+inline void Array::Fill(_Array<float> *a, float value) { _Fill(a, value); }
+inline void Array::Fill(_Array<double> *a, double value) { _Fill(a, value); }
+inline void Array::Fill(_Array<StringPtr> *a, String *value) { _Fill(a, value); }
+
+#if !SEPARATE_RUNTIME
 /* static */ StringPtr String::New(_Array<wchar_t> *a) {
-  wchar_t *from = a->get_location(0);
-  int len = a->get_Length();
-  wchar_t *s = new wchar_t[len + 1];
-  wcsncpy(s, from, len);
-  s[len] = L'\0';
-  return new DynamicString(s);
+  return InlineString::New(a->Elements(), a->get_Length());
+}
+#endif
+
+// Format i in decimal into buf, which must have room for 11 characters, and return the
+// number of characters written.
+inline int _FormatInt(int i, wchar_t *buf) {
+  wchar_t digits[10];
+  unsigned u = i < 0 ? 0u - static_cast<unsigned>(i) : static_cast<unsigned>(i);
+  int n = 0;
+  do {
+    digits[n++] = static_cast<wchar_t>(L'0' + u % 10);
+    u /= 10;
+  } while (u != 0);
+  int len = 0;
+  if (i < 0)
+    buf[len++] = L'-';
+  while (n > 0)
+    buf[len++] = digits[--n];
+  return len;
+}
+
+// Format d as Double::ToString() does into buf, which must have room for 24 characters, and
+// return the number of characters written.
+inline int _FormatDouble(double d, wchar_t *buf) {
+  char s[24];
+  int len = snprintf(s, sizeof(s), "%.10g", d);
+  for (int i = 0; i < len; ++i)
+    buf[i] = s[i];
+  return len;
 }
 
 class StringBuilder : public Object {
   wchar_t * s_;
   int len_;
   int alloc_len_;
+  wchar_t *local_;   // a buffer of our owner's which we start out in, or NULL
+
+protected:
+  StringBuilder(wchar_t *buf, int len) {
+    local_ = s_ = buf;
+    len_ = 0;
+    alloc_len_ = len;
+  }
 
 public:
   StringBuilder() {
+    local_ = NULL;
     Init();
   }
 
+  // We free our buffer as DynamicString does, since ToString() hands the buffer to one.
+  ~StringBuilder() { if (s_ != local_) delete [] s_; }
+
   void Init() {
     len_ = alloc_len_ = 0;
     s_ = NULL;
@@ -947,10 +1858,16 @@ public:
   void Extend(int extra) {
     if (len_ + extra > alloc_len_) {
       alloc_len_ = Int::Max(2 * (len_ + extra), 64);
-      s_ = (wchar_t *) Realloc(s_, alloc_len_ * sizeof(wchar_t));
+      if (s_ != NULL && s_ == local_) {
+        s_ = (wchar_t *) Realloc(NULL, alloc_len_ * sizeof(wchar_t));
+        memcpy(s_, local_, len_ * sizeof(wchar_t));
+      } else s_ = (wchar_t *) Realloc(s_, alloc_len_ * sizeof(wchar_t));
     }
   }
 
+  const wchar_t *_Data() { return s_; }
+  int _Length() { return len_; }
+
   void Append(wchar_t c) {
     Extend(1);
     s_[len_++] = c;
@@ -967,7 +1884,7 @@ public:
   }
 
   void Append(String *s) {
-    Append(s->Get());
+    Append(s->_Data(), s->get_Length());
   }
 
   void AppendFormat(String *str, Object *o1) {
@@ -991,7 +1908,8 @@ public:
           case '2': o = o3; break;
           default: o = NULL; _assert(false, L"bad format specifier");
         }
-        Append(o->ToString());
+        if (o != NULL)   // like C#, we format null as an empty string
+          Append(o->ToString());
         _assert(*++t == L'}', L"bad format specifier");
         s = t + 1;
       }
@@ -999,14 +1917,66 @@ public:
     Append(s, static_cast<int>(t - s));
   }
 
+  // The compiler expands String.Format, AppendFormat and the Write and WriteLine methods
+  // of Console and StreamWriter into chains of these calls when the format string is a
+  // constant, so that arguments aren't boxed and the format isn't parsed at run time.
+  template <int N> StringBuilder &_Append(const wchar_t (&s)[N]) {
+    Append(s, N - 1);
+    return *this;
+  }
+  StringBuilder &_AppendString(String *s) {
+    if (s != NULL)
+      Append(s);
+    return *this;
+  }
+  StringBuilder &_AppendObject(Object *o) {
+    if (o != NULL)
+      Append(o->ToString());
+    return *this;
+  }
+  StringBuilder &_AppendInt(int i) {
+    Extend(11);
+    len_ += _FormatInt(i, s_ + len_);
+    return *this;
+  }
+  StringBuilder &_AppendDouble(double d) {
+    Extend(24);
+    len_ += _FormatDouble(d, s_ + len_);
+    return *this;
+  }
+  StringBuilder &_AppendChar(wchar_t c) {
+    Append(c);
+    return *this;
+  }
+  StringBuilder &_AppendBool(bool b) {
+    Append(b ? L"True" : L"False");
+    return *this;
+  }
+
   StringPtr ToString() {
+    int len = len_;
     Append(L'\0');
-    StringPtr s = new DynamicString(s_);
+    if (s_ == local_) {
+      StringPtr s = InlineString::New(s_, len);
+      len_ = 0;
+      return s;
+    }
+    StringPtr s = new DynamicString(s_, len);
     Init();
     return s;
   }
 };
 
+// a StringBuilder which starts out in a buffer of its own, for text which we write out and
+// discard without making a string of it
+class _LocalStringBuilder : public StringBuilder {
+  wchar_t buf_[128];
+
+public:
+  _LocalStringBuilder() : StringBuilder(buf_, 128) { }
+};
+
+#if !SEPARATE_RUNTIME
 StringPtr String::Format(String *str, Object *o) {
   StringBuilder sb;
   sb.AppendFormat(str, o);
@@ -1024,6 +1994,7 @@ StringPtr String::Format(String *str, Object *o1, Object *o2, Object *o3) {
   sb.AppendFormat(str, o1, o2, o3);
   return sb.ToString();
 }
+#endif
 
 class PoolObject : public Object {
   Object *p_;
@@ -1062,26 +2033,64 @@ class PoolBlock {
 public:
   PoolBlock *prev_;
   char *first_;   // the first object allocated in this block
+  bool trivial_;  // true if no object in this block needs its destructor run
   char data_[1];
 };
 
 class Pool {
-  PoolBlock *top_;  // linked list of fixed-size blocks
-
-  static const unsigned int BlockSize = 8192;
-  static const unsigned int Threshold = 256;
-
-public:
-  Pool() {
-    top_ = 0;
+  PoolBlock *top_;    // linked list of blocks in use
+  PoolBlock *spare_;  // blocks kept by Reset() for reuse
+
+  unsigned int block_size_;
+
+  // If less than this much space remains in the current block, we start a new block in
+  // preference to allocating an object outside the pool.
+  unsigned int threshold_;
+
+  // statistics for the objects currently in the pool
+  int bytes_;      // bytes allocated, including objects allocated outside the pool
+  int blocks_;     // blocks held by the pool, including spare blocks
+  int oversize_;   // number of objects allocated outside the pool since they didn't fit
+
+  static const unsigned int DefaultBlockSize = 8192;
+
+  // Blocks of the default size freed by any pool, kept for reuse by other pools.  The cache
+  // is disabled by default; see SetSharedBlockCache().  Each thread has its own cache, so
+  // a pool must be used only by the thread which created it.
+  static GEL_THREAD_LOCAL PoolBlock *shared_;
+  static GEL_THREAD_LOCAL int shared_count_;
+  static int shared_max_;
+
+  void Init(int block_size) {
+    _assert(block_size >= 1024, L"pool block size must be at least 1024 bytes");
+    block_size_ = block_size;
+    threshold_ = block_size / 32;
+    top_ = spare_ = 0;
+    bytes_ = blocks_ = oversize_ = 0;
     NewBlock();
   }
 
+public:
+  Pool() { Init(DefaultBlockSize); }
+  Pool(int block_size) { Init(block_size); }
+
   void Destroy(PoolBlock *top, bool pass1) {
-    PoolBlock *prev;
-    for (PoolBlock *b = top ; b != 0 ; b = prev) {
-      char *block_end = ((char *) b) + BlockSize;
+    for (PoolBlock *b = top ; b != 0 ; b = b->prev_) {
+      char *block_end = ((char *) b) + block_size_;
       char *p = b->first_;
+      if (b->trivial_) {
+        // Destroying these objects would do nothing, so we skip the block, except that in
+        // a safe build we still check the objects' reference counts in the second pass.
+#if MEMORY_SAFE
+        if (!pass1 && !_exiting)
+          while (p < block_end) {
+            Object *o = (Object *) p;
+            o->_CheckUndestroyed();
+            p += o->_Destroy2();
+          }
+#endif
+        continue;
+      }
       while (p < block_end) {
         Object *o = (Object *) p;
 #if MEMORY_SAFE
@@ -1111,18 +2120,12 @@ public:
           p += o->_Destroy1();
 #endif
       }
-      prev = b->prev_;
-#if MEMORY_SAFE
-      if (_exiting || !pass1)
-        delete b;
-#else
-      delete b;
-#endif
     }
   }
 
-  ~Pool() {
-    // Destroy a pool.  We make two passes since we want group destruction for pools:
+  // Destroy every object in the pool, and return the list of blocks which held them.
+  PoolBlock *DestroyAll() {
+    // We make two passes since we want group destruction for pools:
     // strict destruction would be too limiting for users since objects in pools
     // appear in creation order, which may be unrelated to link structure.
 
@@ -1137,36 +2140,119 @@ public:
     if (!_exiting)
       Destroy(top, false);
 #endif
+    return top;
+  }
+
+  void FreeBlocks(PoolBlock *top) {
+    PoolBlock *prev;
+    for (PoolBlock *b = top ; b != 0 ; b = prev) {
+      prev = b->prev_;
+      if (block_size_ == DefaultBlockSize && shared_count_ < shared_max_) {
+        b->prev_ = shared_;
+        shared_ = b;
+        ++shared_count_;
+      } else delete [] (char *) b;
+    }
+  }
+
+  ~Pool() {
+    FreeBlocks(DestroyAll());
+    FreeBlocks(spare_);
+  }
+
+  // Destroy all objects in the pool, keeping its blocks for further allocations.
+  void Reset() {
+    PoolBlock *prev;
+    for (PoolBlock *b = DestroyAll() ; b != 0 ; b = prev) {
+      prev = b->prev_;
+      b->prev_ = spare_;
+      spare_ = b;
+    }
+    bytes_ = oversize_ = 0;
+    NewBlock();
   }
 
   void NewBlock() {
-    char *d = new char[BlockSize];
-    PoolBlock *b = (PoolBlock *) d;
-    b->first_ = d + BlockSize;
+    PoolBlock *b;
+    if (spare_ != 0) {
+      b = spare_;
+      spare_ = b->prev_;
+    } else if (block_size_ == DefaultBlockSize && shared_ != 0) {
+      b = shared_;
+      shared_ = b->prev_;
+      --shared_count_;
+      ++blocks_;
+    } else {
+      b = (PoolBlock *) new char[block_size_];
+      ++blocks_;
+    }
+    b->first_ = ((char *) b) + block_size_;
+    b->trivial_ = true;
     b->prev_ = top_;
     top_ = b;
   }
 
-  char *Alloc(size_t n) {
+  // Allocate n bytes for an object.  If trivial is true, then destroying the object does
+  // nothing, so we need not visit it when destroying the pool.
+  char *Alloc(size_t n, bool trivial = false) {
     _assert(top_ != 0, L"can't allocate from pool which is being destroyed");
 
     size_t free = top_->first_ - top_->data_;
-    if (n <= free)
+    if (n <= free) {
+      bytes_ += static_cast<int>(n);
+      if (!trivial)
+        top_->trivial_ = false;
       return top_->first_ -= n;
+    }
 
-    if (free < Threshold) {
+    if (free < threshold_) {
       // We don't have much free space; allocate a new block.
       NewBlock();
-      return Alloc(n);
+      return Alloc(n, trivial);
     }
 
-    // We don't have room; perform a non-pool allocation for this object.
+    // We don't have room; perform a non-pool allocation for this object, and allocate a
+    // PoolObject in the pool to destroy it.
     char *d = new char[n];
-    new (Alloc(sizeof(_Own<Object>))) _Own<Object>((Object *) d);
+    new (Alloc(sizeof(PoolObject))) PoolObject((Object *) d);
+    bytes_ += static_cast<int>(n);
+    ++oversize_;
     return d;
   }
+
+  int get_BytesAllocated() { return bytes_; }
+  int get_Blocks() { return blocks_; }
+  int get_OversizeAllocations() { return oversize_; }
+
+  // Keep up to max_blocks freed blocks of the default size for reuse by any pool.
+  static void SetSharedBlockCache(int max_blocks) {
+    shared_max_ = max_blocks;
+    _TrimSharedBlocks(max_blocks);
+  }
+
+  // Free blocks from the current thread's cache until it holds at most max_blocks.
+  static void _TrimSharedBlocks(int max_blocks) {
+    while (shared_count_ > max_blocks) {
+      PoolBlock *b = shared_;
+      shared_ = b->prev_;
+      --shared_count_;
+      delete [] (char *) b;
+    }
+  }
+
+  static int get_SharedBlocks() { return shared_count_; }
 };
 
+template <class T> char *_Array<T>::PoolAlloc(Pool *pool, size_t n, bool trivial) {
+  return pool->Alloc(n, trivial);
+}
+
+#if !SEPARATE_RUNTIME
+GEL_THREAD_LOCAL PoolBlock *Pool::shared_ = 0;
+GEL_THREAD_LOCAL int Pool::shared_count_ = 0;
+int Pool::shared_max_ = 0;
+#endif
+
 class Debug {
 public:
   static void Assert(bool b) {
@@ -1174,6 +2260,10 @@ public:
   }
 };
 
+int gel_runmain(void (*gmain)());
+int gel_runmain(void (*gmain)(_Array<StringPtr > *), int argc, char *argv[]);
+
+#if !SEPARATE_RUNTIME
 #if _MSC_VER
 DWORD _exception_filter(EXCEPTION_POINTERS *p) {
   EXCEPTION_RECORD *r = p->ExceptionRecord;
@@ -1188,6 +2278,7 @@ DWORD _exception_filter(EXCEPTION_POINTERS *p) {
       break;
   }
   if (error) {
+    _FlushOutput();
     printf("runtime error: %s\n", error);
     return EXCEPTION_EXECUTE_HANDLER;
   }
@@ -1195,6 +2286,154 @@ DWORD _exception_filter(EXCEPTION_POINTERS *p) {
 }
 #endif
 
+#ifdef PROFILE_REF_OPS
+static const char *const _profile_columns[_ProfileEvents] =
+  { "ref incs", "ref decs", "allocs", "frees", "pooled" };
+
+// Return a readable name for a class; the caller must free() it.
+static char *_ProfileClassName(const type_info *type) {
+#ifdef __GNUC__
+  int status;
+  char *name = abi::__cxa_demangle(type->name(), 0, 0, &status);
+  if (name)
+    return name;
+#endif
+  return strdup(type->name());
+}
+
+// Order counts by reference count increments, then by allocations and frees, largest first.
+static int _ProfileCompare(const void *a, const void *b) {
+  const _ProfileCounts *c = *(const _ProfileCounts **) a;
+  const _ProfileCounts *d = *(const _ProfileCounts **) b;
+  static const int keys[] = { _ProfileRefInc, _ProfileAlloc, _ProfilePooled, _ProfileFree };
+  for (int i = 0 ; i < 4 ; ++i)
+    if (c->count_[keys[i]] != d->count_[keys[i]])
+      return c->count_[keys[i]] > d->count_[keys[i]] ? -1 : 1;
+  return 0;
+}
+
+static bool _ProfileEmpty(const _ProfileCounts *c) {
+  for (int e = 0 ; e < _ProfileEvents ; ++e)
+    if (c->count_[e])
+      return false;
+  return true;
+}
+
+// Write the counts in c, having already written a name n characters wide.
+static void _ProfileWriteCounts(FILE *f, int n, const _ProfileCounts *c, bool tabs) {
+  for (int e = 0 ; e < _ProfileEvents ; ++e)
+    if (tabs)
+      fprintf(f, "\t%d", c->count_[e]);
+    else fprintf(f, "%*d", e == 0 ? 12 + (n < 36 ? 36 - n : 0) : 12, c->count_[e]);
+  fputc('\n', f);
+}
+
+static void _ProfileWriteHeader(const char *title) {
+  printf("\n%-36s", title);
+  for (int e = 0 ; e < _ProfileEvents ; ++e)
+    printf("%12s", _profile_columns[e]);
+  printf("\n");
+}
+
+// Print counts for each class and for the busiest source lines.  If the environment
+// variable GEL_PROFILE names a file, we also write every count to that file as
+// tab-separated values.
+void _ProfileReport() {
+  const int MaxLines = 50;   // source lines to print
+
+  int class_count = 0;
+  _ProfileClass **classes = (_ProfileClass **) malloc(_ProfileClassMax * sizeof(_ProfileClass *));
+  int total = 0;
+  for (int i = 0 ; i < _ProfileClassMax ; ++i)
+    if (_profile_classes[i].type_ != 0) {
+      classes[class_count++] = &_profile_classes[i];
+      total += _profile_classes[i].count_[_ProfileRefInc];
+    }
+  qsort(classes, class_count, sizeof(_ProfileClass *), _ProfileCompare);
+
+  int site_count = 0;
+  for (_ProfileSite *s = _profile_sites ; s != 0 ; s = s->next_)
+    if (!_ProfileEmpty(s))
+      ++site_count;
+  _ProfileSite **sites = (_ProfileSite **) malloc((site_count + 1) * sizeof(_ProfileSite *));
+  int n = 0;
+  for (_ProfileSite *s = _profile_sites ; s != 0 ; s = s->next_)
+    if (!_ProfileEmpty(s))
+      sites[n++] = s;
+  qsort(sites, site_count, sizeof(_ProfileSite *), _ProfileCompare);
+
+  printf("total ref incs = %d\n", total);
+
+  _ProfileWriteHeader("class");
+  for (int i = 0 ; i < class_count ; ++i) {
+    char *name = _ProfileClassName(classes[i]->type_);
+    _ProfileWriteCounts(stdout, printf("%s", name), classes[i], false);
+    free(name);
+  }
+
+  _ProfileWriteHeader("source line");
+  for (int i = 0 ; i < site_count && i < MaxLines ; ++i)
+    _ProfileWriteCounts(stdout, printf("%s:%d", sites[i]->file_, sites[i]->line_), sites[i], false);
+  if (site_count > MaxLines)
+    printf("(%d more lines)\n", site_count - MaxLines);
+  fflush(stdout);
+
+  const char *path = getenv("GEL_PROFILE");
+  if (path != 0) {
+    FILE *f = fopen(path, "w");
+    if (f == 0)
+      printf("warning: could not write profile to %s\n", path);
+    else {
+      fprintf(f, "kind\tname");
+      for (int e = 0 ; e < _ProfileEvents ; ++e)
+        fprintf(f, "\t%s", _profile_columns[e]);
+      fputc('\n', f);
+      for (int i = 0 ; i < class_count ; ++i) {
+        char *name = _ProfileClassName(classes[i]->type_);
+        fprintf(f, "class\t%s", name);
+        _ProfileWriteCounts(f, 0, classes[i], true);
+        free(name);
+      }
+      for (int i = 0 ; i < site_count ; ++i) {
+        fprintf(f, "line\t%s:%d", sites[i]->file_, sites[i]->line_);
+        _ProfileWriteCounts(f, 0, sites[i], true);
+      }
+      fclose(f);
+    }
+  }
+
+  free(classes);
+  free(sites);
+}
+
+// SIGUSR1 prints a report and lets the program continue; SIGINT prints a report and exits.
+void _ProfileSignalled() {
+  int sig = _AtomicExchange((int *) &_profile_signal, 0);
+  if (!sig)
+    return;   // another thread has just written the report
+  // A thread writing to the console records counts under _profile_mutex while it holds the
+  // console's lock, so we must flush before taking _profile_mutex, not while holding it.
+  _FlushOutput();
+  _Lock lock(_profile_mutex);
+  printf("\n");
+  _ProfileReport();
+#if _UNIX
+  if (sig == SIGINT)
+    _exit(1);
+#endif
+}
+
+#if _UNIX
+// A program which is blocked, or which never reaches a statement, won't see _profile_signal,
+// so a second SIGINT takes the default action and stops the program without a report.
+static void _ProfileSignal(int sig) {
+  if (sig == SIGINT)
+    signal(SIGINT, SIG_DFL);
+  _profile_signal = sig;
+}
+#endif
+#endif  // PROFILE_REF_OPS
+
 void _Initialize() {
 #if MEMORY_CRT && _WINDOWS
 #if _DEBUG 
@@ -1206,11 +2445,15 @@ void _Initialize() {
   if (!HeapSetInformation((HANDLE) crt_heap, HeapCompatibilityInformation, &enable, sizeof(enable)))
     puts("warning: could not enable low fragmentation heap");
 #endif
+#if defined(PROFILE_REF_OPS) && _UNIX
+  signal(SIGUSR1, _ProfileSignal);
+  signal(SIGINT, _ProfileSignal);
+#endif
 }
 
 void gel_runmain_args(void (*gmain)(_Array<StringPtr> *), int argc, char *argv[]) {
   _assert(argc >= 1, L"main() received no argument");
-  _Own<_CopyableArray<StringPtr> > a(new _CopyableArray<StringPtr>(&typeid(String *), argc - 1));
+  _Own<_CopyableArray<StringPtr> > a(_CopyableArray<StringPtr>::New(&typeid(String *), argc - 1));
 #if _WINDOWS
   // On Windows, we ignore argv[] and instead call GetCommandLine(), which gives us
   // arguments in Unicode.
@@ -1243,8 +2486,11 @@ int gel_runmain2(void (*gmain)(), void (*gmain_a)(_Array<StringPtr > *), int arg
   }
 #endif
 #ifdef PROFILE_REF_OPS
-  printf("total ref incs = %d\n", g_totalRefInc);
+  _FlushOutput();
+  _ProfileReport();
 #endif
+  _FlushOutput();
+  _AllocReport();
   return 0;
 }
 
@@ -1255,3 +2501,4 @@ int gel_runmain(void (*gmain)()) {
 int gel_runmain(void (*gmain)(_Array<StringPtr > *), int argc, char *argv[]) {
   return gel_runmain2(0, gmain, argc, argv);
 }
+#endif  // !SEPARATE_RUNTIME
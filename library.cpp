@@ -1,6 +1,14 @@
 #include <limits.h>
 #include <math.h>
 
+#if _WINDOWS
+#include <io.h>
+#include <process.h>  // for _beginthreadex
+#elif _UNIX
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 #if _WINDOWS
 const wchar_t kSeparator = L'\\';
 #elif _UNIX
@@ -16,6 +24,147 @@ class Math {
    }
 };
 
+// encoding
+//
+// Files are read as UTF-8.  A byte which does not begin a valid UTF-8 sequence decodes to
+// the character with the same value, so Latin-1 input still reads as it did when we
+// decoded one byte per character.
+
+// Decode the bytes in [p, p + len) to out, which must have room for len characters.
+// Return the number of bytes consumed, which may be less than len if the bytes end in the
+// middle of a sequence and more is true; *out_len receives the number of characters written.
+int DecodeUtf8(const char *p, int len, bool more, wchar_t *out, int *out_len);
+
+// Decode a complete UTF-8 byte sequence into a string of exactly the right length.
+StringPtr DecodeUtf8(const char *p, int len);
+
+// Encode the characters in [s, s + len) as UTF-8 into out, which must have room for
+// 4 * len bytes; return the number of bytes written.  On platforms with a 16-bit wchar_t we
+// combine surrogate pairs.
+int EncodeUtf8(const wchar_t *s, int len, char *out);
+
+bool IsTerminal(FILE *f);
+
+#if !SEPARATE_RUNTIME
+// Decode one character from the bytes in [p, end), writing one or two (on platforms with
+// a 16-bit wchar_t) characters to out.  Return the number of bytes consumed, or 0 if the
+// bytes end in the middle of a sequence and more input may follow.
+int DecodeUtf8Char(const unsigned char *p, const unsigned char *end, bool more, wchar_t *out,
+                   int *out_count) {
+  *out_count = 1;
+  unsigned int c = *p;
+  if (c < 0x80) {
+    *out = c;
+    return 1;
+  }
+  int n = c >= 0xc2 && c < 0xe0 ? 2 : c >= 0xe0 && c < 0xf0 ? 3 : c >= 0xf0 && c < 0xf5 ? 4 : 0;
+  if (n > 0 && end - p < n && more)
+    return 0;
+  if (n == 0 || end - p < n) {
+    *out = c;   // not a valid sequence
+    return 1;
+  }
+  unsigned int v = c & (0x7f >> n);
+  for (int i = 1; i < n; ++i) {
+    if ((p[i] & 0xc0) != 0x80) {
+      *out = c;
+      return 1;
+    }
+    v = (v << 6) | (p[i] & 0x3f);
+  }
+  if (n == 3 && v < 0x800 || n == 4 && (v < 0x10000 || v > 0x10ffff)) {
+    *out = c;   // overlong or out of range
+    return 1;
+  }
+  if (sizeof(wchar_t) == 2 && v >= 0x10000) {
+    v -= 0x10000;
+    out[0] = static_cast<wchar_t>(0xd800 + (v >> 10));
+    out[1] = static_cast<wchar_t>(0xdc00 + (v & 0x3ff));
+    *out_count = 2;
+    return n;
+  }
+  *out = static_cast<wchar_t>(v);
+  return n;
+}
+
+int DecodeUtf8(const char *p, int len, bool more, wchar_t *out, int *out_len) {
+  const unsigned char *s = reinterpret_cast<const unsigned char *>(p);
+  const unsigned char *end = s + len;
+  wchar_t *o = out;
+  while (s < end) {
+    if (*s < 0x80) {
+      *o++ = *s++;
+      continue;
+    }
+    int count;
+    int n = DecodeUtf8Char(s, end, more, o, &count);
+    if (n == 0)
+      break;
+    s += n;
+    o += count;
+  }
+  *out_len = static_cast<int>(o - out);
+  return static_cast<int>(s - reinterpret_cast<const unsigned char *>(p));
+}
+
+StringPtr DecodeUtf8(const char *p, int len) {
+  const unsigned char *s = reinterpret_cast<const unsigned char *>(p);
+  const unsigned char *end = s + len;
+  int chars = 0;
+  wchar_t buf[2];
+  while (s < end) {
+    if (*s < 0x80) {
+      ++s;
+      ++chars;
+      continue;
+    }
+    int count;
+    s += DecodeUtf8Char(s, end, false, buf, &count);
+    chars += count;
+  }
+  InlineString *t = InlineString::New(chars);
+  int n;
+  DecodeUtf8(p, len, false, t->Chars(), &n);
+  return t;
+}
+
+int EncodeUtf8(const wchar_t *s, int len, char *out) {
+  const wchar_t *end = s + len;
+  char *o = out;
+  while (s < end) {
+    unsigned int c = *s++;
+    if (c < 0x80) {
+      *o++ = static_cast<char>(c);
+      continue;
+    }
+    if (sizeof(wchar_t) == 2 && c >= 0xd800 && c < 0xdc00 && s < end &&
+        *s >= 0xdc00 && *s < 0xe000)
+      c = 0x10000 + ((c - 0xd800) << 10) + (*s++ - 0xdc00);
+    if (c < 0x800) {
+      *o++ = static_cast<char>(0xc0 | c >> 6);
+    } else {
+      if (c < 0x10000)
+        *o++ = static_cast<char>(0xe0 | c >> 12);
+      else {
+        *o++ = static_cast<char>(0xf0 | c >> 18);
+        *o++ = static_cast<char>(0x80 | (c >> 12 & 0x3f));
+      }
+      *o++ = static_cast<char>(0x80 | (c >> 6 & 0x3f));
+    }
+    *o++ = static_cast<char>(0x80 | (c & 0x3f));
+  }
+  return static_cast<int>(o - out);
+}
+
+bool IsTerminal(FILE *f) {
+#if _WINDOWS
+  return _isatty(_fileno(f)) != 0;
+#else
+  return isatty(fileno(f)) != 0;
+#endif
+}
+#endif
+
 // I/O
 
 class File {
@@ -33,25 +182,49 @@ public:
     return false;
   }
 
+  // We map the file (or on Windows, read it in a single call) and decode it directly into
+  // a string of the exact size.
   static StringPtr ReadAllText(String *path) {
-    const int bufsize = 128;
-    char buf[bufsize];
-
-    StringBuilder sb;
+#if _UNIX
+    int fd = open(MultiByteString(path).Get(), O_RDONLY);
+    _assert(fd != -1, L"file not found");
+    struct stat st;
+    _assert(fstat(fd, &st) == 0, L"can't read file");
+    if (st.st_size == 0) {
+      close(fd);
+      return &String::empty_string_;
+    }
+    _assert(st.st_size <= INT_MAX, L"file too large");
+    int size = static_cast<int>(st.st_size);
+    void *p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    _assert(p != MAP_FAILED, L"can't read file");
+    StringPtr s = DecodeUtf8(static_cast<const char *>(p), size);
+    munmap(p, size);
+    return s;
+#else
     FILE *f = fopen(MultiByteString(path).Get(), "r");
     _assert(f != NULL, L"file not found");
-    while (fgets(buf, bufsize, f)) {
-      DynamicString s(buf);   // convert to wide
-      sb.Append(&s);
-    }
-    _assert(feof(f) != 0, L"expected end of file");
-    return sb.ToString();
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *buf = new char[size + 1];
+    int n = static_cast<int>(fread(buf, 1, size, f));   // may be short due to newline translation
+    _assert(ferror(f) == 0, L"can't read file");
+    fclose(f);
+    StringPtr s = DecodeUtf8(buf, n);
+    delete [] buf;
+    return s;
+#endif
   }
 };
 
 class Path {
 public:
+  // As in .NET, return [path2] if it is rooted or [path1] is empty.
   static StringPtr Combine(String *path1, String *path2) {
+    if (path1->get_Length() == 0 || IsPathRooted(path2))
+      return path2;
     StringBuilder sb;
     sb.Append(path1);
     if (!path1->EndsWithChar(kSeparator))
@@ -63,7 +236,7 @@ public:
   static StringPtr GetDirectoryName(String *path) {
     int i = path->LastIndexOf(kSeparator);
     if (i == -1)
-      return path;
+      return &String::empty_string_;   // no directory
 
     if (i == 0 ||   // "/"
         i == 2 && path->get_Item(1) == ':')
@@ -73,11 +246,10 @@ public:
   }
 
   static StringPtr GetExtension(String *path) {
-    const wchar_t *p = path->Get();
-    const wchar_t *e = wcsrchr(p, '.');
-    if (!e)
-      e = L"";
-    return new DynamicString(e, true);
+    int dot_pos = path->LastIndexOf(L'.');
+    if (dot_pos == -1)
+      return &String::empty_string_;
+    return path->Substring(dot_pos, path->get_Length() - dot_pos);
   }
 
   static StringPtr GetFileNameWithoutExtension(String *path) {
@@ -87,6 +259,18 @@ public:
     else return path;
   }
 
+  // Return true if [path] begins with a separator or, on Windows, a drive letter.
+  static bool IsPathRooted(String *path) {
+    int n = path->get_Length();
+    if (n > 0 && path->get_Item(0) == kSeparator)
+      return true;
+#if _WINDOWS
+    if ((n > 0 && path->get_Item(0) == L'/') || (n > 1 && path->get_Item(1) == ':'))
+      return true;
+#endif
+    return false;
+  }
+
   static StringPtr GetTempFileName() {
     char *f = tempnam(NULL, "_g_");
     _assert(f != NULL, L"can't get temporary file name");
@@ -96,63 +280,210 @@ public:
   }
 };
 
+// A StreamReader reads bytes from its file in large blocks and decodes each block at once
+// into a buffer of characters.
 class StreamReader : public Object {
+  static const int BufferSize = 65536;
+
   FILE *file_;
+  char *bytes_;      // bytes read from the file; [byte_pos_, byte_count_) are not yet decoded
+  int byte_pos_, byte_count_;
+  wchar_t *chars_;   // decoded characters; [char_pos_, char_count_) have not yet been read
+  int char_pos_, char_count_;
+  bool eof_;
+
+  // Decode more characters; return false at end of file.
+  bool Fill() {
+    char_pos_ = char_count_ = 0;
+    while (char_count_ == 0) {
+      // Move any partial sequence left over from the last block to the front of the buffer.
+      int left = byte_count_ - byte_pos_;
+      memmove(bytes_, bytes_ + byte_pos_, left);
+      byte_pos_ = 0;
+      byte_count_ = left;
+      if (!eof_) {
+        byte_count_ += static_cast<int>(fread(bytes_ + left, 1, BufferSize - left, file_));
+        eof_ = feof(file_) || ferror(file_);
+      }
+      if (byte_count_ == 0)
+        return false;
+      byte_pos_ = DecodeUtf8(bytes_, byte_count_, !eof_, chars_, &char_count_);
+    }
+    return true;
+  }
 
 public:
   StreamReader(String *filename) {
     file_ = fopen(MultiByteString(filename).Get(), "r");
     _assert(file_ != NULL, L"file not found");
+    setvbuf(file_, NULL, _IONBF, 0);   // we do our own buffering
+    bytes_ = new char[BufferSize];
+    chars_ = new wchar_t[BufferSize];
+    byte_pos_ = byte_count_ = char_pos_ = char_count_ = 0;
+    eof_ = false;
+  }
+
+  ~StreamReader() {
+    delete [] bytes_;
+    delete [] chars_;
   }
 
   void Close() { fclose(file_); }
 
   int Read() {
-    int c = getc(file_);
-    return c == EOF ? -1 : c;
+    if (char_pos_ == char_count_ && !Fill())
+      return -1;
+    return chars_[char_pos_++];
   }
 
   int Peek() {
-    int c = getc(file_);
-    ungetc(c, file_);
-    return c == EOF ? -1 : c;
+    if (char_pos_ == char_count_ && !Fill())
+      return -1;
+    return chars_[char_pos_];
   }
 
-  StringPtr ReadToEnd() {
-    const int bufsize = 128;
-    char buf[bufsize];
+  // Read a line of characters, not including its terminating "\n", "\r" or "\r\n".
+  // Return NULL at end of file.
+  StringPtr ReadLine() {
+    if (char_pos_ == char_count_ && !Fill())
+      return NULL;
+    StringBuilder sb;
+    while (true) {
+      const wchar_t *start = chars_ + char_pos_;
+      const wchar_t *end = chars_ + char_count_;
+      const wchar_t *p = start;
+      while (p < end && *p != L'\n' && *p != L'\r')
+        ++p;
+      sb.Append(start, static_cast<int>(p - start));
+      char_pos_ += static_cast<int>(p - start);
+      if (p < end) {
+        ++char_pos_;
+        if (*p == L'\r' && Peek() == L'\n')
+          ++char_pos_;
+        break;
+      }
+      if (!Fill())
+        break;
+    }
+    return sb.ToString();
+  }
 
+  StringPtr ReadToEnd() {
     StringBuilder sb;
-    while (fgets(buf, bufsize, file_)) {
-      DynamicString s(buf);   // convert to wide
-      sb.Append(&s);
+    while (char_pos_ < char_count_ || Fill()) {
+      sb.Append(chars_ + char_pos_, char_count_ - char_pos_);
+      char_pos_ = char_count_;
     }
-    _assert(feof(file_) != 0, L"expected end of file");
+    _assert(ferror(file_) == 0, L"can't read file");
     return sb.ToString();
   }
 };
 
+// A StreamWriter encodes characters as UTF-8 directly into its own buffer, which it writes
+// to the file when full, on Flush() or Close(), or when it is destroyed.  A line-buffered
+// writer also flushes after every WriteLine.
 class StreamWriter : public Object {
+  static const int DefaultBufferSize = 65536;
+
   FILE *file_;
+  char *buf_;
+  int size_;   // buffer size in bytes
+  int len_;    // number of bytes in the buffer
+  bool line_buffered_;
+
+  void Init(FILE *file, int buffer_size) {
+    _assert(buffer_size > 0, L"buffer size must be positive");
+    file_ = file;
+    setvbuf(file_, NULL, _IONBF, 0);   // we do our own buffering
+    // Leave room to encode one more character (or surrogate pair) when the buffer is nearly full.
+    size_ = buffer_size;
+    buf_ = new char[size_ + 4];
+    len_ = 0;
+    line_buffered_ = false;
+  }
+
+  void Write(const wchar_t *s, int len) {
+    while (len > 0) {
+      if (len_ >= size_)
+        FlushBuffer();
+      // Encode as many characters as will surely fit, keeping surrogate pairs together.
+      int n = (size_ - len_) / 4;
+      if (n == 0)
+        n = 1;
+      if (n > len)
+        n = len;
+      if (sizeof(wchar_t) == 2 && n < len && s[n - 1] >= 0xd800 && s[n - 1] < 0xdc00)
+        ++n;
+      len_ += EncodeUtf8(s, n, buf_ + len_);
+      s += n;
+      len -= n;
+    }
+  }
+
+  void Write(const wchar_t *s) {
+    Write(s, static_cast<int>(wcslen(s)));
+  }
+
+  void FlushBuffer() {
+    if (len_ > 0)
+      fwrite(buf_, 1, len_, file_);
+    len_ = 0;
+  }
 
 public:
   StreamWriter(String *filename) {
-    file_ = fopen(MultiByteString(filename).Get(), "w");
-    _assert(file_ != NULL, L"file not found");
+    Open(filename, DefaultBufferSize);
   }
 
-  StreamWriter(FILE *file) { file_ = file; }
+  StreamWriter(String *filename, int buffer_size) {
+    Open(filename, buffer_size);
+  }
 
-  void Close() { fclose(file_); }
+  StreamWriter(FILE *file) { Init(file, DefaultBufferSize); }
 
-  void Write(const wchar_t *s) {
-    fputs(MultiByteString(s).Get(), file_);
+  ~StreamWriter() {
+    if (file_ != NULL)
+      FlushBuffer();
+    delete [] buf_;
+    buf_ = NULL;   // Console::w_ may still be flushed during exit
   }
 
-public:
+  void Open(String *filename, int buffer_size) {
+    FILE *f = fopen(MultiByteString(filename).Get(), "w");
+    _assert(f != NULL, L"file not found");
+    Init(f, buffer_size);
+  }
+
+  void Close() {
+    FlushBuffer();
+    fclose(file_);
+    file_ = NULL;
+  }
+
+  void Flush() {
+    FlushBuffer();
+    fflush(file_);
+  }
+
+  // Flush the buffer whenever we write a line if b is true, or when it fills otherwise.
+  void SetLineBuffered(bool b) { line_buffered_ = b; }
+
+  // Replace the buffer with one of the given size, flushing any buffered output first.
+  void SetBufferSize(int size) {
+    _assert(size > 0, L"buffer size must be positive");
+    FlushBuffer();
+    delete [] buf_;
+    size_ = size;
+    buf_ = new char[size_ + 4];
+  }
+
+  FILE *_File() { return file_; }
+
   void Write(Object *o) {
-    if (o != NULL)
-      Write(o->ToString()->Get());
+    if (o != NULL) {
+      StringPtr s = o->ToString();
+      Write(s->_Data(), s->get_Length());
+    }
   }
 
   void Write(String *s, Object *o) {
@@ -167,30 +498,58 @@ public:
     Write(String::Format(s, o1, o2, o3));
   }
 
-  void NewLine() { Write(L"\n"); }
+  void NewLine() {
+    Write(L"\n", 1);
+    if (line_buffered_)
+      FlushBuffer();
+  }
 
   void WriteLine(Object *o) { Write(o); NewLine(); }
   void WriteLine(String *s, Object *o) { Write(s, o); NewLine(); }
   void WriteLine(String *s, Object *o1, Object *o2) { Write(s, o1, o2); NewLine(); }
   void WriteLine(String *s, Object *o1, Object *o2, Object *o3) { Write(s, o1, o2, o3); NewLine(); }
+
+  // The compiler expands Write and WriteLine with a constant format string into these, passing
+  // text formatted with StringBuilder's typed appends.
+  void _Write(StringBuilder &sb) { Write(sb._Data(), sb._Length()); }
+  void _WriteLine(StringBuilder &sb) { _Write(sb); NewLine(); }
 };
 
 class Console {
   static StreamWriter w_;
+  static _Mutex mutex_;   // held while writing, once the program is multithreaded
 
 public:
-  static void Write(Object *o) { w_.Write(o); }
-  static void Write(String *s, Object *o) { w_.Write(s, o); }
-  static void Write(String *s, Object *o1, Object *o2) { w_.Write(s, o1, o2); }
-  static void Write(String *s, Object *o1, Object *o2, Object *o3) { w_.Write(s, o1, o2, o3); }
-
-  static void WriteLine(Object *o) { w_.WriteLine(o); }
-  static void WriteLine(String *s, Object *o) { w_.WriteLine(s, o); }
-  static void WriteLine(String *s, Object *o1, Object *o2) { w_.WriteLine(s, o1, o2); }
-  static void WriteLine(String *s, Object *o1, Object *o2, Object *o3) { w_.WriteLine(s, o1, o2, o3); }
+  static void Flush() { _Lock lock(mutex_); w_.Flush(); }
+
+  static void SetBufferSize(int size) { _Lock lock(mutex_); w_.SetBufferSize(size); }
+
+  // If b is true, flush after every line when standard output is a terminal.
+  static void SetLineBufferedIfTerminal(bool b) {
+    _Lock lock(mutex_);
+    w_.SetLineBuffered(b && IsTerminal(w_._File()));
+  }
+
+  static void Write(Object *o) { _Lock lock(mutex_); w_.Write(o); }
+  static void Write(String *s, Object *o) { _Lock lock(mutex_); w_.Write(s, o); }
+  static void Write(String *s, Object *o1, Object *o2) { _Lock lock(mutex_); w_.Write(s, o1, o2); }
+  static void Write(String *s, Object *o1, Object *o2, Object *o3) { _Lock lock(mutex_); w_.Write(s, o1, o2, o3); }
+
+  static void WriteLine(Object *o) { _Lock lock(mutex_); w_.WriteLine(o); }
+  static void WriteLine(String *s, Object *o) { _Lock lock(mutex_); w_.WriteLine(s, o); }
+  static void WriteLine(String *s, Object *o1, Object *o2) { _Lock lock(mutex_); w_.WriteLine(s, o1, o2); }
+  static void WriteLine(String *s, Object *o1, Object *o2, Object *o3) { _Lock lock(mutex_); w_.WriteLine(s, o1, o2, o3); }
+
+  static void _Write(StringBuilder &sb) { _Lock lock(mutex_); w_._Write(sb); }
+  static void _WriteLine(StringBuilder &sb) { _Lock lock(mutex_); w_._WriteLine(sb); }
 };
 
+#if !SEPARATE_RUNTIME
 StreamWriter Console::w_(stdout);
+_Mutex Console::mutex_;
+
+/* declared in internal.cpp */ void _FlushOutput() { Console::Flush(); }
+#endif
 
 // system
 
@@ -217,17 +576,42 @@ class Environment {
 
 public:
   static void Exit(int code) {
-#if MEMORY_SAFE
     _exiting = true;
-#endif
     exit(code);
   }
 
   static OperatingSystem *get_OSVersion() { return &os_; }
 
+  // Return the number of processors available to this process.
+  static int get_ProcessorCount() {
+#if _WINDOWS
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#elif _UNIX
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? static_cast<int>(n) : 1;
+#endif
+  }
+
+  // Return the absolute path of the current working directory.
+  static StringPtr get_CurrentDirectory() {
+#if _WINDOWS
+    wchar_t path[MAX_PATH];
+    DWORD n = GetCurrentDirectory(MAX_PATH, path);
+    _assert(n > 0 && n < MAX_PATH, L"can't retrieve current directory");
+    return InlineString::New(path);
+#elif _UNIX
+    char buf[PATH_MAX];
+    char *p = getcwd(buf, PATH_MAX);
+    _assert(p != NULL, L"can't retrieve current directory");
+    return new DynamicString(buf);
+#endif
+  }
+
   static _Array<StringPtr> *_ArgArray(int argc, wchar_t *argv[]) {
     _assert(argc >= 1, L"main() received no argument");
-    _Array<StringPtr> *a = new _CopyableArray<StringPtr>(&typeid(String *), argc - 1);
+    _Array<StringPtr> *a = _CopyableArray<StringPtr>::New(&typeid(String *), argc - 1);
     for (int i = 1 ; i < argc ; ++i)
       a->get_Item(i - 1) = new String(argv[i]);
     return a;
@@ -240,7 +624,9 @@ public:
   }
 };
 
+#if !SEPARATE_RUNTIME
 OperatingSystem Environment::os_;
+#endif
 
 // A module of a process.  For now, we can only represent the main module of the current process.
 class ProcessModule : public Object {
@@ -250,7 +636,7 @@ public:
     wchar_t path[MAX_PATH];
     DWORD n = GetModuleFileName(NULL, path, MAX_PATH);
     _assert(n > 0 && n < MAX_PATH, L"can't retrieve module path");
-    return new DynamicString(path, true);
+    return InlineString::New(path);
 #elif _UNIX
     // This will work on Linux, but possibly not on other Unix systems.
     char buf[PATH_MAX];
@@ -270,6 +656,7 @@ public:
   virtual ProcessModule *get_MainModule() { Unimplemented(); return 0; }
 
   static int System(String *command) {
+    Console::Flush();   // the child process shares our standard output
     return system(MultiByteString(command).Get());
   }
 };
@@ -279,6 +666,410 @@ public:
   virtual ProcessModule *get_MainModule() { return new ProcessModule(); }
 };
 
+#if !SEPARATE_RUNTIME
 /* static */ Process *Process::GetCurrentProcess() {
   return new CurrentProcess();
 }
+#endif
+
+// threads
+
+// A thread of execution.  A subclass overrides Run(); Start() runs it in a new thread.
+class Thread : public Object {
+#if _WINDOWS
+  HANDLE handle_;
+#elif _UNIX
+  pthread_t thread_;
+#endif
+  bool started_;
+  bool joined_;
+
+  void Exit() {
+    Pool::_TrimSharedBlocks(0);   // free this thread's cached pool blocks
+#if MEMORY_SIZECLASS
+    _SizeClassFlushCache();       // and its cached size-class blocks and allocation counts
+#endif
+  }
+
+#if _WINDOWS
+  static unsigned __stdcall Main(void *p) {
+    Thread *t = static_cast<Thread *>(p);
+    t->Run();
+    t->Exit();
+    return 0;
+  }
+#elif _UNIX
+  static void *Main(void *p) {
+    Thread *t = static_cast<Thread *>(p);
+    t->Run();
+    t->Exit();
+    return NULL;
+  }
+#endif
+
+protected:
+  // used by a GEL2 subclass's constructor, which then calls _Construct()
+  Thread(Dummy *dummy) : started_(false), joined_(false) { }
+  void _Construct() { }
+
+public:
+  Thread() : started_(false), joined_(false) { }
+
+  ~Thread() {
+    _assert(!started_ || joined_, L"thread destroyed before Join");
+  }
+
+  virtual void Run() { }
+
+  void Start() {
+    _assert(!started_, L"thread already started");
+    started_ = true;
+    if (!_threaded)   // other threads may be reading the flag
+      _threaded = true;
+#if _WINDOWS
+    handle_ = (HANDLE) _beginthreadex(NULL, 0, Main, this, 0, NULL);
+    _assert(handle_ != 0, L"can't create thread");
+#elif _UNIX
+    _assert(pthread_create(&thread_, NULL, Main, this) == 0, L"can't create thread");
+#endif
+  }
+
+  // Wait for this thread to finish running.
+  void Join() {
+    _assert(started_ && !joined_, L"thread is not running");
+#if _WINDOWS
+    WaitForSingleObject(handle_, INFINITE);
+    CloseHandle(handle_);
+#elif _UNIX
+    pthread_join(thread_, NULL);
+#endif
+    joined_ = true;
+  }
+};
+
+// tasks
+//
+// Tasks run on a set of worker threads, which we start when a program first starts a task.
+// Each worker has a queue of tasks.  A thread pushes the tasks it starts onto the back of
+// its own queue and takes tasks from there; a thread with nothing to do steals a task from
+// the front of another thread's queue.  Threads other than workers share queue 0.
+
+class Task;
+
+// a double-ended queue of tasks
+class _TaskQueue {
+  _Mutex mutex_;
+  Task **items_;
+  int capacity_;        // always a power of two
+  int front_, back_;    // we hold tasks [front_, back_), indexed modulo capacity_
+
+public:
+  _TaskQueue() : items_(new Task *[16]), capacity_(16), front_(0), back_(0) { }
+  ~_TaskQueue() { delete [] items_; }
+
+  void Push(Task *t) {
+    _Lock lock(mutex_);
+    if (back_ - front_ == capacity_) {
+      Task **items = new Task *[2 * capacity_];
+      for (int i = front_; i < back_; ++i)
+        items[i & (2 * capacity_ - 1)] = items_[i & (capacity_ - 1)];
+      delete [] items_;
+      items_ = items;
+      capacity_ *= 2;
+    }
+    items_[back_++ & (capacity_ - 1)] = t;
+  }
+
+  // Take the task pushed most recently.
+  Task *Pop() {
+    _Lock lock(mutex_);
+    if (front_ == back_)
+      return NULL;
+    return items_[--back_ & (capacity_ - 1)];
+  }
+
+  // Take the task pushed least recently.
+  Task *Steal() {
+    _Lock lock(mutex_);
+    if (front_ == back_)
+      return NULL;
+    Task *t = items_[front_++ & (capacity_ - 1)];
+    if (front_ == back_)
+      front_ = back_ = 0;
+    return t;
+  }
+};
+
+// a condition variable together with the mutex protecting its condition
+class _Condition {
+#if _WINDOWS
+  CRITICAL_SECTION cs_;
+  CONDITION_VARIABLE cv_;
+
+public:
+  _Condition() { InitializeCriticalSection(&cs_); InitializeConditionVariable(&cv_); }
+  ~_Condition() { DeleteCriticalSection(&cs_); }
+  void Lock() { EnterCriticalSection(&cs_); }
+  void Unlock() { LeaveCriticalSection(&cs_); }
+  void Wait() { SleepConditionVariableCS(&cv_, &cs_, INFINITE); }
+  void NotifyAll() { WakeAllConditionVariable(&cv_); }
+#elif _UNIX
+  pthread_mutex_t m_;
+  pthread_cond_t c_;
+
+public:
+  _Condition() { pthread_mutex_init(&m_, NULL); pthread_cond_init(&c_, NULL); }
+  ~_Condition() { pthread_cond_destroy(&c_); pthread_mutex_destroy(&m_); }
+  void Lock() { pthread_mutex_lock(&m_); }
+  void Unlock() { pthread_mutex_unlock(&m_); }
+  void Wait() { pthread_cond_wait(&c_, &m_); }
+  void NotifyAll() { pthread_cond_broadcast(&c_); }
+#endif
+};
+
+class _Scheduler {
+  class Worker : public Thread {
+    int index_;
+
+  public:
+    Worker(int index) : index_(index) { }
+    virtual void Run();
+  };
+
+  _Mutex start_mutex_;
+  int started_;           // read with _AtomicLoad
+  int thread_count_;      // requested number of threads running tasks, or 0 for the default
+  int threads_;           // number of threads running tasks, once started
+  _TaskQueue *queues_;    // one per thread running tasks
+  Worker **workers_;
+
+  _Condition idle_;       // notified when a task is queued or completes
+  int queued_;            // number of tasks in all queues
+  int sleeping_;          // number of threads waiting on idle_; protected by idle_
+  int stopping_;          // set under idle_; read with _AtomicLoad
+
+  static GEL_THREAD_LOCAL int self_;    // index of this thread's queue
+
+  void Start();
+  Task *Find();
+  void Sleep(Task *t);
+
+public:
+  _Scheduler() : started_(0), thread_count_(0), threads_(0), queues_(NULL), workers_(NULL),
+                 queued_(0), sleeping_(0), stopping_(0) { }
+  ~_Scheduler();
+
+  void Push(Task *t);
+  void Wait(Task *t);
+  void Notify();
+
+  int ThreadCount() {
+    return thread_count_ != 0 ? thread_count_ : Environment::get_ProcessorCount();
+  }
+
+  void SetThreadCount(int count) {
+    _assert(count >= 1, L"thread count must be positive");
+    _assert(!_AtomicLoad(&started_), L"can't set thread count after starting a task");
+    thread_count_ = count;
+  }
+};
+
+#if !SEPARATE_RUNTIME
+GEL_THREAD_LOCAL int _Scheduler::self_ = 0;
+#endif
+
+class Task : public Object {
+  int done_;        // set once Run() has returned; read with _AtomicLoad
+  bool started_;
+  bool waited_;
+
+protected:
+  // used by a GEL2 subclass's constructor, which then calls _Construct()
+  Task(Dummy *dummy) : done_(0), started_(false), waited_(false) { }
+  void _Construct() { }
+
+public:
+  Task() : done_(0), started_(false), waited_(false) { }
+
+  ~Task() {
+    _assert(!started_ || waited_, L"task destroyed before Wait");
+  }
+
+  virtual void Run() { }
+
+  void Start();
+
+  // Wait for Run() to return, running other tasks in the meantime.
+  void Wait();
+
+  bool _Done() { return _AtomicLoad(&done_) != 0; }
+
+  void _Execute();
+};
+
+extern _Scheduler _scheduler;
+
+#if !SEPARATE_RUNTIME
+_Scheduler _scheduler;
+
+void _Scheduler::Worker::Run() {
+  self_ = index_;
+  _scheduler.Wait(NULL);
+}
+
+void _Scheduler::Start() {
+  _Lock lock(start_mutex_);
+  if (started_)
+    return;
+  int n = threads_ = ThreadCount();
+  queues_ = new _TaskQueue[n];
+  workers_ = new Worker *[n - 1];
+  for (int i = 1; i < n; ++i) {
+    workers_[i - 1] = new Worker(i);
+    workers_[i - 1]->Start();
+  }
+  _AtomicStore(&started_, 1);
+}
+
+_Scheduler::~_Scheduler() {
+  if (!started_)
+    return;
+  idle_.Lock();
+  _AtomicStore(&stopping_, 1);
+  idle_.NotifyAll();
+  idle_.Unlock();
+  for (int i = 1; i < threads_; ++i)
+    if (i != self_) {   // a worker can't wait for itself, e.g. in Environment.Exit()
+      workers_[i - 1]->Join();
+      delete workers_[i - 1];
+    }
+  delete [] workers_;
+  delete [] queues_;
+}
+
+void _Scheduler::Push(Task *t) {
+  if (!_AtomicLoad(&started_))
+    Start();
+  queues_[self_].Push(t);
+  _AtomicIncrement(&queued_);
+  Notify();
+}
+
+// Take a task from our own queue, or else steal one.
+Task *_Scheduler::Find() {
+  Task *t = queues_[self_].Pop();
+  for (int i = 1; t == NULL && i < threads_; ++i)
+    t = queues_[(self_ + i) % threads_].Steal();
+  if (t != NULL)
+    _AtomicDecrement(&queued_);
+  return t;
+}
+
+// Sleep until a task is queued or t completes.
+void _Scheduler::Sleep(Task *t) {
+  idle_.Lock();
+  ++sleeping_;
+  while (_AtomicLoad(&queued_) == 0 && !(t != NULL ? t->_Done() : stopping_ != 0))
+    idle_.Wait();
+  --sleeping_;
+  idle_.Unlock();
+}
+
+// Run tasks until t completes; if t is NULL, run tasks until the scheduler stops.
+void _Scheduler::Wait(Task *t) {
+  while (t != NULL ? !t->_Done() : !_AtomicLoad(&stopping_)) {
+    Task *u = Find();
+    if (u != NULL)
+      u->_Execute();
+    else Sleep(t);
+  }
+}
+
+// Wake any sleeping threads, since a task was queued or has completed.
+void _Scheduler::Notify() {
+  idle_.Lock();
+  if (sleeping_ > 0)
+    idle_.NotifyAll();
+  idle_.Unlock();
+}
+
+void Task::Start() {
+  _assert(!started_, L"task already started");
+  started_ = true;
+  _scheduler.Push(this);
+}
+
+void Task::Wait() {
+  _assert(started_, L"task not started");
+  _scheduler.Wait(this);
+  waited_ = true;
+}
+
+void Task::_Execute() {
+  Run();
+  _AtomicStore(&done_, 1);
+  _scheduler.Notify();
+}
+#endif
+
+// the body of a Parallel.For loop
+class LoopBody : public Object {
+protected:
+  LoopBody(Dummy *dummy) { }
+  void _Construct() { }
+
+public:
+  LoopBody() { }
+
+  virtual void Run(int i) { }
+
+  virtual void RunRange(int from, int to) {
+    for (int i = from; i < to; ++i)
+      Run(i);
+  }
+};
+
+// a task running part of a Parallel.For loop
+class _LoopTask : public Task {
+public:
+  LoopBody *body_;
+  int from_, to_;
+
+  virtual void Run() { body_->RunRange(from_, to_); }
+};
+
+class Parallel {
+public:
+  // Run body for each integer in [from, to).  We split the range into several chunks per
+  // thread so that threads which finish early can steal work from others.
+  static void For(int from, int to, LoopBody *body) {
+    if (to <= from)
+      return;
+    long long n = (long long) to - from;
+    int chunks = 8 * _scheduler.ThreadCount();
+    if (chunks > n)
+      chunks = (int) n;
+    if (chunks == 1) {
+      body->RunRange(from, to);
+      return;
+    }
+    _LoopTask *tasks = new _LoopTask[chunks];
+    for (int i = 0; i < chunks; ++i) {
+      tasks[i].body_ = body;
+      tasks[i].from_ = (int) (from + n * i / chunks);
+      tasks[i].to_ = (int) (from + n * (i + 1) / chunks);
+    }
+    for (int i = chunks - 1; i > 0; --i)
+      tasks[i].Start();
+    tasks[0].Run();   // run the first chunk ourselves
+    for (int i = 1; i < chunks; ++i)
+      tasks[i].Wait();
+    delete [] tasks;
+  }
+
+  static int get_ThreadCount() { return _scheduler.ThreadCount(); }
+
+  // Set the number of threads which run tasks, including a thread waiting for a task.  This
+  // may be called only before the first task starts.
+  static void SetThreadCount(int count) { _scheduler.SetThreadCount(count); }
+};